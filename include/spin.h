@@ -47,6 +47,8 @@ namespace spin {
     // Types
     struct ThreadContext;  // opaque to tool
     typedef uint32_t ThreadId;
+    // Thread ids are below this (Pin's limit is 2Kthreads, as of 2.12)
+    const uint32_t MAX_THREADS = 2048;
     typedef void (*CaptureCallback)(ThreadId tid, bool runsNext);
     typedef ThreadId (*UncaptureCallback)(ThreadId tid, ThreadContext* tc);
     typedef void (*ThreadCallback)(ThreadId tid);
@@ -57,6 +59,94 @@ namespace spin {
     // not (to support synchronous syscalls).
     typedef bool (*SyscallEnterCallback)(ThreadId tid, ThreadContext* tc);
     typedef void (*SyscallExitCallback)(ThreadId tid, ThreadContext* tc);
+    typedef void (*ForkCallback)(uint32_t childIdx);
+    // Emulates a syscall on the executor: writes results (e.g., RAX) to tc
+    // and returns true, or returns false to run the syscall normally
+    typedef bool (*SyscallEmulator)(ThreadId tid, ThreadContext* tc);
+    // Called at a detected spin-wait; returns the thread to run next
+    typedef ThreadId (*SpinCallback)(ThreadId tid, uint64_t pc);
+    // Called while no thread is runnable; returns the thread to run next, or
+    // -1 to wait for one to be unblocked or captured
+    typedef ThreadId (*IdleCallback)();
+    // Returns thread tid's virtual time, in ns
+    typedef uint64_t (*TimeCallback)(ThreadId tid);
+
+    // Code cache pressure levels, from least to most degraded (see
+    // enableCodePressurePolicy())
+    enum CodePressure {
+        PRESSURE_NONE,
+        PRESSURE_COMPACT,  // new traces use compact register transfers
+        PRESSURE_COARSE,  // ...and the tool should use coarser switchpoints
+    };
+    typedef void (*CodePressureCallback)(CodePressure level);
+
+    // How SyscallGuard handles a syscall while other threads are captured
+    enum SyscallPolicy {
+        SYSCALL_AUTO,  // keep the executor role if measured to be reliably short
+        SYSCALL_SHIP,  // uncapture the thread and switch to another one
+        SYSCALL_KEEP,  // keep the executor role (others wait unless it blocks)
+    };
+
+    // Measured durations of a syscall number (from the physical thread
+    // entering the kernel until it comes back to libspin)
+    struct SyscallStats {
+        uint64_t count;
+        uint64_t totalNs;
+        uint64_t maxNs;
+        uint64_t avgNs;  // recent (exponentially weighted) average
+        uint64_t longCount;  // runs over 1 ms, treated as blocking
+        uint64_t keptCount;  // runs that kept the executor role
+        bool keepsExecutor;  // current decision
+    };
+
+    // How often the executor role moved to another physical thread, and how
+    // many of those moves also changed the core it runs on. Counted only
+    // while executor CPUs are set (see setExecutorCpus()).
+    struct ExecutorHandoffStats {
+        uint64_t handoffs;
+        uint64_t coreChanges;
+    };
+
+    // Code cache eviction activity (see enableTraceEviction())
+    struct TraceEvictionStats {
+        uint64_t passes;
+        uint64_t tracesEvicted;
+        uint64_t rangesInvalidated;
+        uint64_t fullFlushes;  // forced, when the cache was about to fill up
+    };
+
+    // Runtime counters (see getStats())
+    struct ThreadStats {
+        uint64_t switchesIn;  // times it was switched to
+        uint64_t captures;
+        uint64_t uncaptures;
+        uint64_t syscalls;  // that reached SyscallGuard (not emulated)
+        uint64_t shippedSyscalls;  // run after an uncapture
+    };
+
+    struct Stats {
+        uint64_t switches;  // to a different thread
+        uint64_t captures;
+        uint64_t uncaptures;
+        uint64_t delayedUncaptures;
+        uint64_t syscalls;
+        uint64_t shippedSyscalls;
+        uint64_t keptSyscalls;  // ran while keeping the executor role
+        uint64_t slowJumps;  // switches after rep instructions (fast mode)
+        uint64_t genericRegReads;  // transfers of uncommon regs (fast mode)
+        uint64_t genericRegWrites;
+        uint64_t codeCacheFlushes;  // all, including Pin's own
+        uint64_t forcedFlushes;  // by libspin, when the cache was about to fill up
+        uint64_t replayLockedSwitchpoints;  // replayed near an event, taking the executor lock
+        std::vector<ThreadStats> threads;  // by tid, up to the highest active one
+    };
+
+    // Contention on libspin's executor lock (wait cycles are TSC cycles)
+    struct LockStats {
+        uint64_t acquires;
+        uint64_t contended;
+        uint64_t waitCycles;
+    };
 
     typedef std::vector< std::tuple<INS, IPOINT, std::function<void()> > > CallpointVector;
 
@@ -65,11 +155,23 @@ namespace spin {
     REG __getTidReg();
     REG __getSwitchReg();
 
+    // Whether IARGs pass the running thread's context to the analysis call
+    inline bool __isContextArg(REG r) { return r == __getContextReg(); }
+    inline bool __isContextArg(IARG_TYPE t) { return t == IARG_CONTEXT || t == IARG_CONST_CONTEXT || t == IARG_PARTIAL_CONTEXT; }
+    template <typename T> inline bool __isContextArg(T) { return false; }
+    inline bool __passesContext() { return false; }
+    template <typename T, typename ...Args> inline bool __passesContext(T arg, Args... args) {
+        return __isContextArg(arg) || __passesContext(args...);
+    }
+
     // Instrumentation: all analysis functions must be registered through this interface
     class TraceInfo {
         private:
             CallpointVector callpoints;
             CallpointVector switchpoints;
+            // Per switchpoint: whether its switchcall gets the context (slow
+            // mode saves the context before those only; see insertSwitchCall)
+            std::vector<bool> switchpointContexts;
 
         public:
             template <typename ...Args>
@@ -93,6 +195,10 @@ namespace spin {
                 callpoints.push_back(std::make_tuple(ins, ipoint, insLambda));
             }
 
+            // NOTE: In slow mode, only switchcalls that take the context
+            // (IARG_SPIN_CONTEXT) see the running thread's current registers;
+            // others skip saving them unless they switch, so they must not
+            // read or write them through getContext()
             template <typename ...Args>
             void insertSwitchCall(INS ins, IPOINT ipoint, AFUNPTR func, Args... args) {
                 auto insLambda = [=] (Args... args) {
@@ -100,6 +206,7 @@ namespace spin {
                 };
                 std::function<void()> f = std::bind(insLambda, args...);
                 switchpoints.push_back(std::make_tuple(ins, ipoint, f));
+                switchpointContexts.push_back(__passesContext(args...));
             }
 
             // Same as insertCall, but takes an IARGLIST instead of loose arguments
@@ -110,10 +217,13 @@ namespace spin {
                     IARGLIST_Free(list);
                 };
                 switchpoints.push_back(std::make_tuple(ins, ipoint, insLambda));
+                switchpointContexts.push_back(true);  // can't tell
             }
 
             friend void InstrumentTrace(TRACE trace, VOID* v);
             friend void Instrument(TRACE trace, const TraceInfo& pt);
+            friend void InsertSpinSwitchCalls(TRACE trace, TraceInfo& pt);
+            friend void InsertVdsoSwitchCalls(TRACE trace, TraceInfo& pt);
     };
 
     typedef void (*TraceCallback)(TRACE, TraceInfo&);
@@ -124,6 +234,189 @@ namespace spin {
     void setSyscallEnterCallback(SyscallEnterCallback syscallEnterCb);
     void setSyscallExitCallback(SyscallExitCallback syscallExitCb);
 
+    // Syscall emulation: the executor handles syscall nr itself, right after
+    // syscallEnterCallback, without uncapturing the thread or waking its
+    // physical thread. If the emulator returns true, the thread continues
+    // after the syscall. Pass nullptr to stop emulating nr.
+    void setSyscallEmulator(uint64_t nr, SyscallEmulator emulator);
+    // Emulator that runs the syscall from the executor's own thread. Only
+    // valid for syscalls whose effects do not depend on the calling thread.
+    bool runSyscallOnExecutor(ThreadId tid, ThreadContext* tc);
+    // Emulate a built-in set of syscalls that are safe to run from any thread
+    // (getpid, uname, brk, time, non-thread clock_gettime, getrusage, etc.);
+    // sched_yield becomes a no-op. The clock syscalls are left to
+    // enableVirtualTime() if it was called, in either order.
+    void enableBuiltinSyscallEmulation();
+
+    // Futex emulation: libspin runs FUTEX_WAIT/WAKE, their bitset variants,
+    // REQUEUE, CMP_REQUEUE, and WAKE_OP itself, blocking and unblocking
+    // guest threads instead of uncapturing them. When the running thread
+    // waits, waitCb picks the next thread to run (like UncaptureCallback);
+    // when a waiter wakes up, wakeCb is called (like CaptureCallback, with
+    // runsNext = false). Only libspin unblocks futex waiters. Timed waits,
+    // waits on exiting threads (pthread_join), and waits by the only captured
+    // thread still go to the kernel.
+    void enableFutexEmulation(UncaptureCallback waitCb, CaptureCallback wakeCb);
+
+    // I/O offload: read, write, their p- and v- variants, sendmsg, and
+    // recvmsg run asynchronously through io_uring, without waking the
+    // issuing thread's physical thread. The issuing thread blocks, and blockCb
+    // picks the next thread to run (like UncaptureCallback). On completion,
+    // libspin writes the result to RAX, calls syscallExitCallback and then
+    // completeCb (like CaptureCallback, with runsNext = false) from its
+    // completion thread. Not used while recording or replaying schedules, in
+    // fork-server children, or when it's the only captured thread. Returns
+    // false if io_uring is unavailable. Only the completion unblocks a thread
+    // with I/O in flight: unblock() and unblockMask() skip it (and don't
+    // count it), and so do timer expirations.
+    bool enableIoOffload(UncaptureCallback blockCb, CaptureCallback completeCb);
+
+    // Adaptive syscall policy: libspin measures each syscall number, and by
+    // default keeps the executor role (instead of an uncapture and a handoff
+    // to another physical thread) for syscalls that are reliably short. If a
+    // kept syscall blocks, a watchdog thread (spawned on the first kept
+    // syscall) uncaptures it after ~1 ms, and it's shipped until it's short
+    // again. Only the executor thread's own syscalls can keep the executor
+    // role; a syscall by another thread the executor runs is always shipped
+    // to that thread's physical thread. setSyscallPolicy() overrides this
+    // for syscall nr; syscallEnterCallback returning false still disallows
+    // uncaptures entirely.
+    void setSyscallPolicy(uint64_t nr, SyscallPolicy policy);
+    SyscallStats getSyscallStats(uint64_t nr);
+
+    // Latencies of waking physical threads to take the executor role or run
+    // a syscall, as a histogram: element i counts wakeups that took
+    // [2^i, 2^(i+1)) TSC cycles since the waker posted them. dumpStats()
+    // reports its percentiles.
+    std::vector<uint64_t> getHandoffLatencies();
+    ExecutorHandoffStats getExecutorHandoffStats();
+
+    // Run the executor on the given CPUs: whichever physical thread takes
+    // the executor role migrates onto them, and threads running shipped
+    // syscalls move to the process's other CPUs, so the executor keeps its
+    // caches warm across handoffs. An empty set (the default) leaves
+    // placement to the OS. Call after init() and before starting the program.
+    void setExecutorCpus(const std::vector<uint32_t>& cpus);
+
+    // Evict cold traces before the code cache fills up, instead of relying
+    // only on forced full flushes (which re-JIT everything and leak memory).
+    // Each trace counts its runs, and libspin samples the counts every ~16K
+    // switches (an epoch). Once the cache is highWaterPct% full, the next
+    // switch invalidates traces that did not run in the last coldEpochs
+    // epochs and do not overlap traces that did, at most once per epoch.
+    // Call after init() and before starting the program.
+    void enableTraceEviction(uint32_t highWaterPct = 75, uint32_t coldEpochs = 4);
+    TraceEvictionStats getTraceEvictionStats();
+
+    // Degrade instrumentation as code cache use grows, instead of crashing
+    // on memory. Every few hundred new traces, libspin checks how full the
+    // code cache is and how fast Pin's memory grows. At compactPct% full, or
+    // above maxGrowthMBps, it moves to PRESSURE_COMPACT: new traces (in fast
+    // mode) move each instruction sequence's registers with one outlined
+    // call instead of one inlined call per register, which is slower but
+    // much smaller. At coarsePct% full, it moves to PRESSURE_COARSE, which
+    // asks the tool to insert fewer switchpoints in new traces (check
+    // getCodePressure() from the trace callback). A forced full flush moves
+    // up a level. Levels only go up. Each change calls cb (if not null) from
+    // instrumentation, so it must not block. Call after init() and before
+    // starting the program.
+    void enableCodePressurePolicy(CodePressureCallback cb, uint32_t compactPct = 50,
+            uint32_t coarsePct = 75, uint64_t maxGrowthMBps = 64);
+    CodePressure getCodePressure();
+
+    // Runtime counters, always on: plain increments by the executor or with
+    // libspin's lock held (code cache flushes, counted from Pin's callback,
+    // are atomic increments). getStats() takes a snapshot (racy if guest
+    // threads are running). dumpStats() prints a summary, e.g., from a Pin
+    // fini function.
+    Stats getStats();
+    void dumpStats();
+
+    // Count acquisitions of libspin's executor lock, how many were contended,
+    // and how long they waited. Off by default, as the counters themselves
+    // add (small) overheads to every acquisition. The lock implementation is
+    // chosen at build time with scons --libspinLock=futex|ticket|mcs|adaptive.
+    void enableLockStats();
+    LockStats getExecutorLockStats();
+
+    // Allow the last runnable thread to block: a switchcall may call
+    // blockAfterSwitch() and return the same thread. The executor then
+    // idles instead of running guest code: it calls idleCb (if not null)
+    // without libspin's locks held, which can unblock threads (e.g., after
+    // advancing simulated time) and return one to run, or return -1 to wait.
+    // Waits sleep until unblock() or a capture makes a thread runnable; the
+    // first such thread runs, unless idleCb picks another when it's called
+    // again. A capture that gets runsNext always runs next. The executor
+    // resumes like at any other switch. Unsupported with recordSchedule()
+    // and replaySchedule().
+    void enableIdling(IdleCallback idleCb);
+
+    // Virtual time: answer RDTSC/RDTSCP (at tscMHz, with RDTSCP reporting
+    // CPU 0), clock_gettime, gettimeofday, and time from timeCb, both as
+    // syscalls and through the vDSO (whose symbols need PIN_InitSymbols();
+    // vDSO calls are emulated before any tool switchcall at their entry
+    // runs). These take precedence over enableBuiltinSyscallEmulation()
+    // and setSyscallEmulator() calls made before. Realtime clocks start at
+    // the host's time when this is called; CPU-time clocks are not
+    // virtualized. nanosleep and clock_nanosleep block the thread until the
+    // clock advanced with advanceClock() (in the same monotonic ns) reaches
+    // their deadline, without leaving the executor: sleepCb, like an
+    // uncapture callback, returns the thread to run meanwhile (with a single
+    // runnable thread, the executor idles if enableIdling() was called, or
+    // the kernel sleeps otherwise), and wakeCb tells the tool the sleeper is
+    // runnable again (with runsNext = false). Call after init() and before
+    // starting the program.
+    void enableVirtualTime(TimeCallback timeCb, uint64_t tscMHz, UncaptureCallback sleepCb, CaptureCallback wakeCb);
+
+    // Spin-wait detection: treat PAUSE instructions, and if detectLoops is
+    // set, short loops that only load, compare, and branch back, as implicit
+    // switchpoints that call spinCb (like a switchcall, it can return another
+    // thread to yield to). Instructions where the tool already inserted a
+    // switchcall are left alone. Call after init() and before starting the
+    // program; code instrumented earlier is not affected.
+    void setSpinCallback(SpinCallback spinCb, bool detectLoops);
+
+    // Multi-process serialization: processes that join the same domain (a
+    // POSIX shared-memory name) share a single executor token, so only one
+    // guest thread across all of them runs at a time. procIdx must be unique
+    // within the domain and < 64. Call after init(). Forked children leave
+    // the domain, and may join it again with a different procIdx. The last
+    // process to exit unlinks the segment.
+    void joinDomain(const char* name, uint32_t procIdx);
+    // Join with the lowest procIdx not in use by a live member, and return
+    // it. Indexes of exited processes are reused, so processes that fork
+    // (e.g., joining again from a fork callback) never collide.
+    uint32_t joinDomain(const char* name);
+    // Pass the token to another process in the domain, and wait until it is
+    // passed back or released. Returns false without passing it if that
+    // process is not waiting for the token. Call only from switchcalls.
+    bool domainHandoff(uint32_t procIdx);
+
+    // Fork-server snapshots: call from a switchcall to fork nchildren copies
+    // of the process (at most maxConcurrent running at once), which inherit
+    // the code cache and all tool state. Each child calls postForkCb with its
+    // index (e.g., to pick a configuration) and returns true to continue the
+    // run. The parent waits for all children and exits. Returns false without
+    // forking if some live thread is uncaptured; retry at a later switchcall.
+    // In children, the executor runs all syscalls itself, so syscalls that
+    // create threads are unsupported, and signal syscalls are only supported
+    // from the forking thread. Futexes are always emulated (through
+    // uncaptureCallback/captureCallback unless enableFutexEmulation() set
+    // others); other blocking syscalls that wait on other guest threads must
+    // be handled by the tool.
+    bool forkServer(uint32_t nchildren, uint32_t maxConcurrent, ForkCallback postForkCb);
+
+    // Schedule record and replay. Call one after init() and before starting
+    // the program. recordSchedule() logs every switch, uncapture, capture,
+    // block, and unblock to file, positioned by the number of switchpoints
+    // run since the previous event. replaySchedule() enforces a recorded
+    // schedule without calling switchcalls or uncaptureCallback (and ignores
+    // the tool's block/unblock calls), holding each capture until its
+    // recorded position. Replay needs the same switchpoints as the recording;
+    // register writes and speculation done from switchcalls are not replayed.
+    void recordSchedule(const char* file);
+    void replaySchedule(const char* file);
+
     // Context querying/manipulation methods
     uint64_t getReg(const ThreadContext* tc, REG reg);
     void setReg(ThreadContext* tc, REG reg, uint64_t val);
@@ -133,10 +426,68 @@ namespace spin {
     ThreadContext* getContext(ThreadId tid);
 
     // Thread blocking/unblocking
-    void blockAfterSwitch(); /* block current thread immediately after the switchcall; must have other running threads */
+    void blockAfterSwitch(); /* block current thread immediately after the switchcall; must have other running threads, unless idling is enabled */
     void blockIdleThread(ThreadId tid); /* thread must not be the running one */
     void unblock(ThreadId tid);
 
+    // Runnable (idle) thread queries, in O(1) with tzcnt-style bit scans.
+    // Iterate with firstIdle() and nextIdleAfter(), which return -1 when
+    // done. Call from switchcalls and other libspin callbacks, where thread
+    // states are stable.
+    ThreadId firstIdle();
+    ThreadId nextIdleAfter(ThreadId tid);
+    uint32_t countIdle();
+    // Raw idle bitmap word: bit i is set iff thread 64*word + i is idle
+    uint64_t getIdleMask(uint32_t word);
+    // Batch unblock: unblocks threads 64*word + i for each bit i set in mask
+    // that are blocked (like unblock(), including the running thread after
+    // blockAfterSwitch(), but not threads with offloaded I/O in flight);
+    // returns how many were unblocked
+    uint32_t unblockMask(uint32_t word, uint64_t mask);
+
+    // Virtual-core run queues. Once enabled, libspin keeps idle threads in
+    // one FIFO queue per virtual core: each thread has a home core (tid %
+    // numCores unless set), and joins the back of its home queue when it
+    // becomes idle. nextOnCore() returns the thread at the front of the
+    // core's queue in O(1), for a switchcall to return. If the queue is
+    // empty, the core steals the back of another core's queue that holds at
+    // least minStealLength threads, per the steal policy (STEAL_NEXT takes
+    // the first such core after it, STEAL_BUSIEST the longest queue), and
+    // the stolen thread moves its home to the thief. Returns -1 if there is
+    // no thread to run. All cores belong to the single executor.
+    enum StealPolicy { STEAL_NONE, STEAL_NEXT, STEAL_BUSIEST };
+    void enableVirtualCores(uint32_t numCores, StealPolicy steal, uint32_t minStealLength = 1);
+    ThreadId nextOnCore(uint32_t core);
+    void setThreadCore(ThreadId tid, uint32_t core);
+    uint32_t getThreadCore(ThreadId tid);
+    uint32_t getCoreQueueLength(uint32_t core);
+    uint64_t getSteals();
+
+    // Timed blocking on a clock that the tool advances (it starts at 0).
+    // blockUntil() blocks tid until the clock reaches time: like
+    // blockAfterSwitch() if tid is the running thread (call it from the
+    // switchcall), like blockIdleThread() otherwise. It does nothing if time
+    // has already passed. advanceClock() moves the clock forward and unblocks
+    // every thread whose time has come, in time order, at a cost
+    // proportional to the number unblocked. unblock() before then cancels the
+    // timer. getNextDeadline() returns the earliest pending time, if any,
+    // e.g., for an idle callback (see enableIdling()) to skip ahead to.
+    void blockUntil(ThreadId tid, uint64_t time);
+    void advanceClock(uint64_t time);
+    uint64_t getClock();
+    bool getNextDeadline(uint64_t* time);
+
+    // Speculation support. checkpoint() saves the thread's registers and logs
+    // its memory writes from then on (only speculative threads pay for this).
+    // commit() drops the checkpoint; rollback() undoes the logged writes in
+    // reverse order and restores the registers, including the PC. Only call
+    // from switchcalls; tid can be the running thread. x87 state and memory
+    // written by syscalls are not rolled back.
+    void checkpoint(ThreadId tid);
+    void commit(ThreadId tid);
+    void rollback(ThreadId tid);
+    bool isSpeculative(ThreadId tid);
+
     // Force the currently-running switchcall to run again, even if we return
     // the same thread (returning a different thread will cause the switchcall
     // to run again the next time this thread is invoked, as usual)
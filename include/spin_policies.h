@@ -0,0 +1,271 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef SPIN_POLICIES_H_
+#define SPIN_POLICIES_H_
+
+/* Scheduling policies for libspin tools.
+ *
+ * Each policy picks among the threads in libspin's idle (runnable) bitmap,
+ * so it keeps no run queue of its own and needs no locks: libspin only calls
+ * switchcalls and uncapture callbacks from the executor, where thread states
+ * are stable. Randomized policies draw from their own seeded generator, so
+ * given the same seed and the same sequence of calls they make the same
+ * choices.
+ *
+ * Every policy has two methods:
+ *  - next(cur): for switchcalls; returns cur or an idle thread to switch to.
+ *  - other(cur): for uncapture callbacks; returns an idle thread other than
+ *    cur (libspin only calls those when one exists).
+ * Tools can call them from their own switchcalls (e.g., every N
+ * instructions), or use switchcall<Policy> and uncapture<Policy> below as
+ * complete callbacks, which run on a per-policy static instance.
+ *
+ * RoundRobin and Random only scan bitmap words, but StaticPriority,
+ * WeightedFair, and Lottery visit every idle thread on each decision, so
+ * they cost O(idle threads) per switchcall. With many runnable threads and
+ * frequent switchcalls, call them less often (e.g., every N instructions).
+ */
+
+#include <stdint.h>
+#include "spin.h"
+
+namespace spin {
+namespace policies {
+
+// xorshift64* generator; deterministic for a given seed
+class Rng {
+    private:
+        uint64_t state;
+
+    public:
+        explicit Rng(uint64_t seed) : state(seed ? seed : 0x9E3779B97F4A7C15ul) {}
+
+        uint64_t next() {
+            state ^= state >> 12;
+            state ^= state << 25;
+            state ^= state >> 27;
+            return state * 0x2545F4914F6CDD1Dul;
+        }
+
+        // Uniform-enough in [0, n) for n much smaller than 2^64
+        uint64_t below(uint64_t n) { return next() % n; }
+};
+
+// The i-th idle thread in tid order (0-based), or -1 if there are fewer
+inline ThreadId nthIdle(uint32_t i) {
+    for (uint32_t w = 0; w < MAX_THREADS / 64; w++) {
+        uint64_t mask = getIdleMask(w);
+        uint32_t n = __builtin_popcountl(mask);
+        if (i < n) {
+            while (i--) mask &= mask - 1;
+            return w * 64 + __builtin_ctzl(mask);
+        }
+        i -= n;
+    }
+    return -1u;
+}
+
+// Cycles through idle threads in tid order, starting after cur
+class RoundRobin {
+    public:
+        ThreadId next(ThreadId cur) {
+            ThreadId tid = other(cur);
+            return (tid == -1u) ? cur : tid;
+        }
+
+        ThreadId other(ThreadId cur) {
+            ThreadId tid = nextIdleAfter(cur);
+            return (tid == -1u) ? firstIdle() : tid;
+        }
+};
+
+// Picks uniformly among cur and the idle threads
+class Random {
+    private:
+        Rng rng;
+
+    public:
+        explicit Random(uint64_t seed = 1) : rng(seed) {}
+
+        ThreadId next(ThreadId cur) {
+            uint32_t idle = countIdle();
+            uint32_t i = rng.below(idle + 1);
+            return (i == idle) ? cur : nthIdle(i);
+        }
+
+        ThreadId other(ThreadId cur) {
+            uint32_t idle = countIdle();
+            return idle ? nthIdle(rng.below(idle)) : -1u;
+        }
+};
+
+// Runs the highest-priority thread; round-robins among equal priorities.
+// Threads default to priority 0. O(idle threads) per decision.
+class StaticPriority {
+    private:
+        uint32_t prios[MAX_THREADS];
+
+        // Highest-priority idle thread, scanning in round-robin order from cur
+        ThreadId best(ThreadId cur) const {
+            ThreadId bestTid = -1u;
+            for (ThreadId tid = nextIdleAfter(cur); tid != -1u; tid = nextIdleAfter(tid)) {
+                if (bestTid == -1u || prios[tid] > prios[bestTid]) bestTid = tid;
+            }
+            for (ThreadId tid = firstIdle(); tid != -1u && tid < cur; tid = nextIdleAfter(tid)) {
+                if (bestTid == -1u || prios[tid] > prios[bestTid]) bestTid = tid;
+            }
+            return bestTid;
+        }
+
+    public:
+        StaticPriority() {
+            for (uint32_t i = 0; i < MAX_THREADS; i++) prios[i] = 0;
+        }
+
+        void setPriority(ThreadId tid, uint32_t prio) { prios[tid] = prio; }
+        uint32_t getPriority(ThreadId tid) const { return prios[tid]; }
+
+        ThreadId next(ThreadId cur) {
+            ThreadId tid = best(cur);
+            return (tid == -1u || prios[tid] < prios[cur]) ? cur : tid;
+        }
+
+        ThreadId other(ThreadId cur) { return best(cur); }
+};
+
+// Stride scheduling: each decision charges the running thread a stride
+// inversely proportional to its weight, and runs the thread with the lowest
+// pass. Threads that were blocked or uncaptured rejoin at the current pass,
+// so they don't monopolize the executor to catch up. Weights default to 1.
+// O(idle threads) per decision.
+class WeightedFair {
+    private:
+        static const uint64_t STRIDE1 = 1ul << 20;
+        uint64_t passes[MAX_THREADS];
+        uint32_t weights[MAX_THREADS];
+        uint64_t globalPass;
+
+        ThreadId minIdle() {
+            ThreadId bestTid = -1u;
+            for (ThreadId tid = firstIdle(); tid != -1u; tid = nextIdleAfter(tid)) {
+                if (passes[tid] < globalPass) passes[tid] = globalPass;
+                if (bestTid == -1u || passes[tid] < passes[bestTid]) bestTid = tid;
+            }
+            return bestTid;
+        }
+
+        void charge(ThreadId cur) {
+            if (passes[cur] < globalPass) passes[cur] = globalPass;
+            passes[cur] += STRIDE1 / weights[cur];
+        }
+
+    public:
+        WeightedFair() : globalPass(0) {
+            for (uint32_t i = 0; i < MAX_THREADS; i++) {
+                passes[i] = 0;
+                weights[i] = 1;
+            }
+        }
+
+        void setWeight(ThreadId tid, uint32_t weight) { weights[tid] = weight ? weight : 1; }
+        uint32_t getWeight(ThreadId tid) const { return weights[tid]; }
+
+        ThreadId next(ThreadId cur) {
+            charge(cur);
+            ThreadId tid = minIdle();
+            if (tid == -1u || passes[tid] >= passes[cur]) tid = cur;
+            globalPass = passes[tid];
+            return tid;
+        }
+
+        ThreadId other(ThreadId cur) {
+            charge(cur);
+            ThreadId tid = minIdle();
+            if (tid != -1u) globalPass = passes[tid];
+            return tid;
+        }
+};
+
+// Lottery scheduling: picks among cur and the idle threads with probability
+// proportional to their tickets. Threads default to 1 ticket. O(idle
+// threads) per decision.
+class Lottery {
+    private:
+        Rng rng;
+        uint32_t tickets[MAX_THREADS];
+
+        ThreadId draw(ThreadId cur, bool includeCur) {
+            uint64_t total = includeCur ? tickets[cur] : 0;
+            for (ThreadId tid = firstIdle(); tid != -1u; tid = nextIdleAfter(tid)) total += tickets[tid];
+            if (!total) return -1u;
+            uint64_t r = rng.below(total);
+            for (ThreadId tid = firstIdle(); tid != -1u; tid = nextIdleAfter(tid)) {
+                if (r < tickets[tid]) return tid;
+                r -= tickets[tid];
+            }
+            return cur;  // r fell in cur's tickets
+        }
+
+    public:
+        explicit Lottery(uint64_t seed = 1) : rng(seed) {
+            for (uint32_t i = 0; i < MAX_THREADS; i++) tickets[i] = 1;
+        }
+
+        void setTickets(ThreadId tid, uint32_t n) { tickets[tid] = n; }
+        uint32_t getTickets(ThreadId tid) const { return tickets[tid]; }
+
+        ThreadId next(ThreadId cur) { return draw(cur, true); }
+        ThreadId other(ThreadId cur) { return draw(cur, false); }
+};
+
+/* Complete callbacks, running on a static instance of each policy. Configure
+ * it (seed, priorities, ...) through instance<Policy>(), e.g.,
+ *   policies::instance<policies::Lottery>() = policies::Lottery(seed);
+ *   spin::init(trace, start, end, policies::ignoreCapture,
+ *              policies::uncapture<policies::Lottery>);
+ *   ... pt.insertSwitchCall(ins, IPOINT_BEFORE,
+ *              (AFUNPTR)policies::switchcall<policies::Lottery>, IARG_SPIN_THREAD_ID);
+ */
+template <typename Policy> Policy& instance() {
+    static Policy policy;
+    return policy;
+}
+
+template <typename Policy> ThreadId switchcall(ThreadId tid) {
+    return instance<Policy>().next(tid);
+}
+
+template <typename Policy> ThreadId uncapture(ThreadId tid, ThreadContext* tc) {
+    return instance<Policy>().other(tid);
+}
+
+// Policies pick from the idle bitmap, so captures need no bookkeeping
+inline void ignoreCapture(ThreadId tid, bool runsNext) {}
+
+}  // namespace policies
+}  // namespace spin
+
+#endif  // SPIN_POLICIES_H_
@@ -40,6 +40,7 @@
 #include <set>
 
 #include <immintrin.h>  // for __m256
+#include <syscall.h>
 
 // When defined, reads and writes check that tc is valid, BUT THEY CANNOT BE
 // INLINED. Thus, these carry a ~5x perf penalty!!
@@ -68,16 +69,93 @@ struct ThreadContext {
     typedef std::array<uint64_t, 4> ymmReg;
     ymmReg fpRegs[REG_YMM_LAST - REG_YMM_BASE + 1];
 
+    // Registers written since pinCtxt was last synced (see DirtyBit()), so
+    // UpdatePinContext() pushes only those. RIP changes nearly every trace,
+    // so it is not tracked and always pushed.
+    uint64_t dirty;
+
+    // PC of the syscall the thread left to take with its registers loaded
+    // from here (see SetToolRegs()), or 0. Lets InitContext() refresh only
+    // what that syscall may clobber.
+    uint64_t syscallPc;
+
     // All other regs use a normal context (huge, and accessor methods are
     // slow, but should be accessed sparingly)
     CONTEXT pinCtxt;
 };
 
+/* Dirty bits: RFLAGS, then GPRs, then YMM regs */
+static const uint32_t DIRTY_RFLAGS = 0;
+static const uint32_t DIRTY_GPR = 1;
+static const uint32_t DIRTY_YMM = DIRTY_GPR + REG_GR_LAST - REG_GR_BASE + 1;
+static const uint64_t DIRTY_ALL = (1ul << (DIRTY_YMM + REG_YMM_LAST - REG_YMM_BASE + 1)) - 1;
+
+constexpr uint64_t DirtyBit(REG r) {
+    return (r == REG_RFLAGS)? 1ul << DIRTY_RFLAGS :
+        ((uint32_t)r >= REG_GR_BASE && (uint32_t)r <= REG_GR_LAST)? 1ul << (DIRTY_GPR + r - REG_GR_BASE) :
+        ((uint32_t)r >= REG_YMM_BASE && (uint32_t)r <= REG_YMM_LAST)? 1ul << (DIRTY_YMM + r - REG_YMM_BASE) :
+        0;
+}
+
+/* Checkpoints: only the hot state, which is what userspace code writes.
+ * Segment regs are read-only, and we do not checkpoint the rest of pinCtxt
+ * (x87 state and other rarely-used regs).
+ */
+struct ContextCheckpoint {
+    uint64_t rip;
+    uint64_t rflags;
+    uint64_t gpRegs[REG_GR_LAST - REG_GR_BASE + 1];
+    ThreadContext::ymmReg fpRegs[REG_YMM_LAST - REG_YMM_BASE + 1];
+};
+
+inline void SaveCheckpoint(const ThreadContext* tc, ContextCheckpoint* ckpt) {
+    CHECK_TC(tc);
+    ckpt->rip = tc->rip;
+    ckpt->rflags = tc->rflags;
+    std::copy(std::begin(tc->gpRegs), std::end(tc->gpRegs), ckpt->gpRegs);
+    std::copy(std::begin(tc->fpRegs), std::end(tc->fpRegs), ckpt->fpRegs);
+}
+
+inline void RestoreCheckpoint(ThreadContext* tc, const ContextCheckpoint* ckpt) {
+    CHECK_TC(tc);
+    tc->rip = ckpt->rip;
+    tc->rflags = ckpt->rflags;
+    std::copy(std::begin(ckpt->gpRegs), std::end(ckpt->gpRegs), tc->gpRegs);
+    std::copy(std::begin(ckpt->fpRegs), std::end(ckpt->fpRegs), tc->fpRegs);
+    tc->dirty = DIRTY_ALL;
+}
+
 /* Init interface */
 
+// Syscalls that change state beyond RAX, RCX, R11, RFLAGS, and RIP (or
+// don't return to the instruction after the syscall)
+inline bool SyscallChangesContext(uint64_t nr) {
+    return nr == SYS_rt_sigreturn || nr == SYS_arch_prctl || nr == SYS_execve || nr == SYS_execveat;
+}
+
+// Refreshes tc from ctxt. A thread coming back from its own syscall (with tc
+// loaded into its registers) has only the registers that the syscall
+// instruction clobbers changed, so if ctxt is right after that syscall,
+// refresh just those and leave the rest of tc and pinCtxt as they were.
 inline void InitContext(const CONTEXT* ctxt, ThreadContext* tc) {
     CHECK_TC(tc);
+    uint64_t syscallPc = tc->syscallPc;
+    tc->syscallPc = 0;
+    // syscall, sysenter and int 0x80 are all 2 bytes
+    if (syscallPc && PIN_GetContextReg(ctxt, REG_RIP) == syscallPc + 2 &&
+            !SyscallChangesContext(tc->gpRegs[REG_RAX - REG_GR_BASE])) {
+        tc->rip = syscallPc + 2;
+        tc->rflags = PIN_GetContextReg(ctxt, REG_RFLAGS);
+        for (REG r : {REG_RAX, REG_RCX, REG_R11}) {
+            tc->gpRegs[r - REG_GR_BASE] = PIN_GetContextReg(ctxt, r);
+            tc->dirty |= DirtyBit(r);
+        }
+        tc->dirty |= DirtyBit(REG_RFLAGS);
+        return;
+    }
+
     PIN_SaveContext(ctxt, &tc->pinCtxt);
+    tc->dirty = 0;
 
     tc->rip = PIN_GetContextReg(ctxt, REG_RIP);
     tc->rflags = PIN_GetContextReg(ctxt, REG_RFLAGS);
@@ -98,22 +176,28 @@ inline void InitContext(const CONTEXT* ctxt, ThreadContext* tc) {
     }
 }
 
+// Pushes RIP and the dirty registers to pinCtxt
 inline void UpdatePinContext(ThreadContext* tc) {
     CHECK_TC(tc);
     PIN_SetContextReg(&tc->pinCtxt, REG_RIP, tc->rip);
-    PIN_SetContextReg(&tc->pinCtxt, REG_RFLAGS, tc->rflags);
-
-    for (uint32_t i = REG_GR_BASE; i <= REG_GR_LAST; i++) {
-        PIN_SetContextReg(&tc->pinCtxt, (REG)i, tc->gpRegs[i - REG_GR_BASE]);
-    }
 
     // NOTE: No need to update segment regs, which are read-only
 
-    for (uint32_t i = REG_YMM_BASE; i <= REG_YMM_LAST; i++) {
-        REG r = (REG)i;
-        assert(REG_Size(r) == sizeof(__m256));
-        PIN_SetContextRegval(&tc->pinCtxt, (REG)i, (uint8_t*)&tc->fpRegs[i - REG_YMM_BASE]);
+    uint64_t dirty = tc->dirty;
+    while (dirty) {
+        uint32_t bit = __builtin_ctzl(dirty);
+        dirty &= dirty - 1;
+        if (bit == DIRTY_RFLAGS) {
+            PIN_SetContextReg(&tc->pinCtxt, REG_RFLAGS, tc->rflags);
+        } else if (bit < DIRTY_YMM) {
+            PIN_SetContextReg(&tc->pinCtxt, (REG)(REG_GR_BASE + bit - DIRTY_GPR), tc->gpRegs[bit - DIRTY_GPR]);
+        } else {
+            REG r = (REG)(REG_YMM_BASE + bit - DIRTY_YMM);
+            assert(REG_Size(r) == sizeof(__m256));
+            PIN_SetContextRegval(&tc->pinCtxt, r, (uint8_t*)&tc->fpRegs[bit - DIRTY_YMM]);
+        }
     }
+    tc->dirty = 0;
 }
 
 
@@ -152,6 +236,7 @@ template <REG r> void ReadFPReg(const ThreadContext* tc, PIN_REGISTER* reg) {
 // Slow, Pin does not inline, invalid for the regs above
 void ReadGenericReg(const ThreadContext* tc, REG r, PIN_REGISTER* val) {
     CHECK_TC(tc);
+    stats.genericRegReads++;
     PIN_GetContextRegval(&tc->pinCtxt, r, (uint8_t*)val);
 }
 
@@ -167,13 +252,14 @@ void ReadFPState(const ThreadContext* tc, CONTEXT* partialCtxt) {
 template <REG r> inline void WriteReg(ThreadContext* tc, ADDRINT regVal);
 
 template <> inline void WriteReg<REG_RIP>(ThreadContext* tc, ADDRINT regVal) { CHECK_TC(tc); tc->rip = regVal; }
-template <> inline void WriteReg<REG_RFLAGS>(ThreadContext* tc, ADDRINT regVal) { CHECK_TC(tc); tc->rflags = regVal; }
+template <> inline void WriteReg<REG_RFLAGS>(ThreadContext* tc, ADDRINT regVal) { CHECK_TC(tc); tc->rflags = regVal; tc->dirty |= DirtyBit(REG_RFLAGS); }
 
 template <REG r> inline void WriteReg(ThreadContext* tc, ADDRINT regVal) {
     CHECK_TC(tc);
     constexpr uint32_t i = (uint32_t)r;
     if (i >= REG_GR_BASE && i <= REG_GR_LAST) {
         tc->gpRegs[i - REG_GR_BASE] = regVal;
+        tc->dirty |= DirtyBit(r);
     } else {
         assert(false);  // should not be called (and -O3 will not dead-eliminate this code)
     }
@@ -186,19 +272,24 @@ template <REG r> void WriteFPReg(ThreadContext* tc, const PIN_REGISTER* reg) {
     constexpr uint32_t i = (uint32_t)r;
     static_assert(i >= REG_YMM_BASE && i <= REG_YMM_LAST, "Only valid for YMM regs");
     for (uint32_t w = 0; w < 4; w++) tc->fpRegs[i - REG_YMM_BASE][w] = reg->qword[w];
+    tc->dirty |= DirtyBit(r);
 }
 
 // Slow, Pin does not inline, invalid for the regs above
 inline void WriteGenericReg(ThreadContext* tc, REG r, const PIN_REGISTER* val) {
     CHECK_TC(tc);
+    stats.genericRegWrites++;
     PIN_SetContextRegval(&tc->pinCtxt, r, (uint8_t*)val);
 }
 
-// For x87 registers (WriteGenericReg does not work on them)
+// For x87 registers (WriteGenericReg does not work on them). The FPSTATE
+// also holds the XMM regs (YMM low halves), which may be stale in
+// partialCtxt, so re-push all of tc's YMM regs over them.
 void WriteFPState(ThreadContext* tc, const CONTEXT* partialCtxt) {
     FPSTATE fpState;
     PIN_GetContextFPState(partialCtxt, &fpState);
     PIN_SetContextFPState(&tc->pinCtxt, &fpState);
+    tc->dirty |= DIRTY_ALL & ~((1ul << DIRTY_YMM) - 1);
 }
 
 }
@@ -193,8 +193,24 @@ namespace spin {
 // avoid an infinite loop, the moment the switchcall returns the same thread,
 // it jumps to version 1, which does not have the initial jump test. All
 // version 1 traces ALWAYS immediately jump to mode 0.
+//
+// Speculative threads (see spin::checkpoint()) log their memory writes, and
+// run in a second pair of versions, UNDOLOG and UNDOLOG_NOJUMP, so that
+// non-speculative threads pay nothing. undoReg holds whether the running
+// thread logs; switches set it, and the head of every default trace moves to
+// the other pair if it does not match the trace's version.
 #define TRACE_VERSION_DEFAULT (0)
 #define TRACE_VERSION_NOJUMP  (1)
+#define TRACE_VERSION_UNDOLOG (2)
+#define TRACE_VERSION_UNDOLOG_NOJUMP (3)
+
+#define TRACE_VERSION_NOJUMP_BIT (1)
+#define TRACE_VERSION_UNDOLOG_BIT (2)
+
+// SwitchHandler returns curTid - SWITCH_MODE_ONLY when the switchcall kept the
+// same thread but changed its undo logging mode (any real switch yields a
+// tidReg - switchReg value of at most MAX_THREADS)
+#define SWITCH_MODE_ONLY (MAX_THREADS + 1)
 
 /* Thread context state */
 std::array<ThreadContext, MAX_THREADS> contexts;
@@ -219,6 +235,37 @@ void CoalesceContext(const CONTEXT* ctxt, ThreadContext* tc) {
     UpdatePinContext(tc);
 }
 
+/* Guard support. Unlike in slow mode, the tid and undo regs keep their values
+ * while the thread is out in a syscall, so if it comes back to run its own
+ * context at the same PC, it can just continue through the trace: all the
+ * registers it reads come from tc anyway.
+ */
+void SetToolRegs(CONTEXT* ctxt, ThreadId tid, bool isSyscall) {
+    // Syscalls run with tc's registers, so InitContext() can refresh tc cheaply
+    if (isSyscall) GetTC(tid)->syscallPc = GetTC(tid)->rip;
+    PIN_SetContextReg(ctxt, tcReg, (ADDRINT)(isSyscall? nullptr : GetTC(tid)));
+    PIN_SetContextReg(ctxt, tidReg, tid);
+    PIN_SetContextReg(ctxt, undoReg, undoLogging[tid]);
+}
+
+// A starting thread's tc is stale (e.g., left by an earlier thread with the
+// same tid), so InitContext() must not take the syscall fast path with it
+void ClearSyscallPc(ThreadId tid) {
+    GetTC(tid)->syscallPc = 0;
+}
+
+// ctxt has the tool regs the thread left with; the trace version it resumes
+// in must match its undo logging mode
+bool CanResumeInPlace(ThreadId tid, const CONTEXT* ctxt, ADDRINT resumePc) {
+    return GetTC(tid)->rip == resumePc &&
+        PIN_GetContextReg(ctxt, tidReg) == tid &&
+        PIN_GetContextReg(ctxt, undoReg) == undoLogging[tid];
+}
+
+void ResumeInPlace(ThreadId tid) {}
+
+void InsertGuardResume(INS ins) {}  // tidReg and undoReg survive syscalls
+
 /* Public context functions */
 uint64_t getReg(const ThreadContext* tc, REG reg) {
     assert(tc);
@@ -251,8 +298,10 @@ void setReg(ThreadContext* tc, REG reg, uint64_t val) {
         NotifySetPC(GetContextTid(tc));
     } else if (reg == REG_RFLAGS) {
         tc->rflags = val;
+        tc->dirty |= DirtyBit(reg);
     } else if (regIdx >= REG_GR_BASE && regIdx <= REG_GR_LAST) {
         tc->gpRegs[regIdx - REG_GR_BASE] = val;
+        tc->dirty |= DirtyBit(reg);
     } else {
         panic("setReg(): Register %s (%d) not supported for now (edit me!)",
                 REG_StringShort(reg).c_str(), regIdx);
@@ -278,6 +327,101 @@ std::string RegSetToStr(const std::set<REG>& regs) {
     return ss.str();
 }
 
+// The syscall guard gets a partial context that covers all the state the
+// thread keeps in tc, so the executor can load its own context and let the
+// syscall instruction run (see LoadSyscallContext) instead of using ExecuteAt.
+void InsertSyscallGuard(INS ins, AFUNPTR guard) {
+    REGSET inSet, outSet;
+    REGSET_Clear(inSet); REGSET_Clear(outSet);
+    for (REG r : {REG_RIP, tcReg, tidReg}) REGSET_Insert(inSet, r);
+    for (auto r : x87Regs) REGSET_Insert(outSet, r);
+    for (uint32_t i = REG_GR_BASE; i <= REG_GR_LAST; i++) REGSET_Insert(outSet, (REG)i);
+    for (uint32_t i = REG_YMM_BASE; i <= REG_YMM_LAST; i++) REGSET_Insert(outSet, (REG)i);
+    for (REG r : {REG_RFLAGS, tcReg, tidReg, undoReg}) REGSET_Insert(outSet, r);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, guard,
+            IARG_THREAD_ID, IARG_PARTIAL_CONTEXT, &inSet, &outSet,
+            IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
+}
+
+bool LoadSyscallContext(ThreadId tid, CONTEXT* ctxt) {
+    ThreadContext* tc = GetTC(tid);
+    // FP state first, as it includes the XMM halves of the YMM regs
+    FPSTATE fpState;
+    PIN_GetContextFPState(&tc->pinCtxt, &fpState);
+    PIN_SetContextFPState(ctxt, &fpState);
+
+    PIN_SetContextReg(ctxt, REG_RFLAGS, tc->rflags);
+    for (uint32_t i = REG_GR_BASE; i <= REG_GR_LAST; i++) {
+        PIN_SetContextReg(ctxt, (REG)i, tc->gpRegs[i - REG_GR_BASE]);
+    }
+    for (uint32_t i = REG_YMM_BASE; i <= REG_YMM_LAST; i++) {
+        PIN_SetContextRegval(ctxt, (REG)i, (uint8_t*)&tc->fpRegs[i - REG_YMM_BASE]);
+    }
+    SetToolRegs(ctxt, tid, true);
+    return true;
+}
+
+/* Compact transfers, used under code cache pressure (see
+ * enableCodePressurePolicy()): one outlined call per instruction sequence
+ * moves all of its GPRs, RFLAGS, and YMM regs through a partial context,
+ * instead of one inlined call per register. Masks use DirtyBit() positions.
+ */
+static const uint32_t MIN_BULK_REGS = 3;
+
+void BulkReadRegs(const ThreadContext* tc, CONTEXT* ctxt, uint64_t mask) {
+    while (mask) {
+        uint32_t bit = __builtin_ctzl(mask);
+        mask &= mask - 1;
+        if (bit == DIRTY_RFLAGS) {
+            PIN_SetContextReg(ctxt, REG_RFLAGS, tc->rflags);
+        } else if (bit < DIRTY_YMM) {
+            PIN_SetContextReg(ctxt, (REG)(REG_GR_BASE + bit - DIRTY_GPR), tc->gpRegs[bit - DIRTY_GPR]);
+        } else {
+            PIN_SetContextRegval(ctxt, (REG)(REG_YMM_BASE + bit - DIRTY_YMM), (const uint8_t*)&tc->fpRegs[bit - DIRTY_YMM]);
+        }
+    }
+}
+
+void BulkWriteRegs(ThreadContext* tc, const CONTEXT* ctxt, uint64_t mask) {
+    tc->dirty |= mask;
+    while (mask) {
+        uint32_t bit = __builtin_ctzl(mask);
+        mask &= mask - 1;
+        if (bit == DIRTY_RFLAGS) {
+            tc->rflags = PIN_GetContextReg(ctxt, REG_RFLAGS);
+        } else if (bit < DIRTY_YMM) {
+            tc->gpRegs[bit - DIRTY_GPR] = PIN_GetContextReg(ctxt, (REG)(REG_GR_BASE + bit - DIRTY_GPR));
+        } else {
+            PIN_GetContextRegval(ctxt, (REG)(REG_YMM_BASE + bit - DIRTY_YMM), (uint8_t*)&tc->fpRegs[bit - DIRTY_YMM]);
+        }
+    }
+}
+
+// Inserts a bulk transfer of regs if compact transfers are on and it's worth
+// it. Returns the mask of regs it covers (0 if none).
+uint64_t InsertBulkTransfer(INS ins, IPOINT ipoint, CALL_ORDER callOrder, const std::set<REG>& regs, bool isRead) {
+    if (codePressure < PRESSURE_COMPACT) return 0;
+    uint64_t mask = 0;
+    REGSET regSet, emptySet;
+    REGSET_Clear(regSet); REGSET_Clear(emptySet);
+    for (REG r : regs) {
+        if (!DirtyBit(r)) continue;
+        mask |= DirtyBit(r);
+        REGSET_Insert(regSet, r);
+    }
+    if (__builtin_popcountl(mask) < MIN_BULK_REGS) return 0;
+    if (isRead) {
+        INS_InsertCall(ins, ipoint, (AFUNPTR)BulkReadRegs, IARG_REG_VALUE, tcReg,
+                IARG_PARTIAL_CONTEXT, &emptySet, &regSet, IARG_UINT64, mask,
+                IARG_CALL_ORDER, callOrder, IARG_END);
+    } else {
+        INS_InsertCall(ins, ipoint, (AFUNPTR)BulkWriteRegs, IARG_REG_VALUE, tcReg,
+                IARG_PARTIAL_CONTEXT, &regSet, &emptySet, IARG_UINT64, mask,
+                IARG_CALL_ORDER, callOrder, IARG_END);
+    }
+    return mask;
+}
+
 void InsertRegReads(INS ins, IPOINT ipoint, CALL_ORDER callOrder, const std::set<REG>& inRegs) {
     // Not all x87 state is in accessible regs, and the REG_X87 pseudo-register
     // can't be accessed through GetContextRegval. So every time we see X87, we
@@ -293,9 +437,12 @@ void InsertRegReads(INS ins, IPOINT ipoint, CALL_ORDER callOrder, const std::set
                 IARG_PARTIAL_CONTEXT, &inSet, &outSet, IARG_CALL_ORDER, callOrder, IARG_END);
     }
 
+    uint64_t bulkRegs = InsertBulkTransfer(ins, ipoint, callOrder, inRegs, true);
+
     for (REG r : inRegs) {
         if (r == REG_RIP) continue;  // RIP is always loaded/saved in context switches
         if (x87Regs.count(r)) continue;  // already handled
+        if (DirtyBit(r) & bulkRegs) continue;  // already handled
 
         AFUNPTR fp;
         bool nextClass = false;
@@ -386,9 +533,12 @@ void InsertRegWrites(INS ins, IPOINT ipoint, CALL_ORDER callOrder, const std::se
                 IARG_PARTIAL_CONTEXT, &inSet, &outSet, IARG_CALL_ORDER, callOrder, IARG_END);
     }
 
+    uint64_t bulkRegs = InsertBulkTransfer(ins, ipoint, callOrder, outRegs, false);
+
     for (REG r : outRegs) {
         if (r == REG_RIP) continue;  // RIP must be handled differently
         if (x87Regs.count(r)) continue;  // already handled
+        if (DirtyBit(r) & bulkRegs) continue;  // already handled
 
         AFUNPTR fp;
         bool nextClass = false;
@@ -480,16 +630,25 @@ void CompareRegs(ThreadContext* tc, const CONTEXT* ctxt) {
     for (uint32_t i = 0; i < 16; i++) compRegs((REG)((int)REG_GR_BASE + i), tc->gpRegs[i], "gpr");
 }
 
-uint64_t SwitchHandler(THREADID tid, PIN_REGISTER* tcRegRef, uint64_t nextTid) {
+uint64_t SwitchHandler(THREADID tid, PIN_REGISTER* tcRegRef, PIN_REGISTER* undoRegRef, uint64_t nextTid) {
     ThreadContext* tc = (ThreadContext*)tcRegRef->qword[0];
     assert(tc);
     DEBUG_SWITCH("[%d] Switch @ 0x%lx tc %lx (%ld -> %ld)", tid, tc->rip,
                  (uintptr_t)tc, GetContextTid(tc), nextTid);
-    RecordSwitch(tid, tc, nextTid);
+    bool modeOnly = IsUndoModeSwitch(nextTid);
+    bool captureOnly = IsCaptureOnlySwitch(nextTid);
+    nextTid = RecordSwitch(tid, tc, nextTid);
+    if (captureOnly) return nextTid;  // continue in the NOJUMP version
     tcRegRef->qword[0] = (ADDRINT)GetTC(nextTid);
+    undoRegRef->qword[0] = undoLogging[nextTid];
+    if (modeOnly) return nextTid - SWITCH_MODE_ONLY;  // continue in the other NOJUMP version
     return -1ul;  // switch
 }
 
+void RecordUndo(ThreadContext* tc, ADDRINT addr, UINT32 size) {
+    undoLogs[GetContextTid(tc)].record(addr, size);
+}
+
 // Used in SwitchHandler inlining
 uint64_t Subtract(uint64_t v1, uint64_t v2) { return v1 - v2; }
 
@@ -497,9 +656,11 @@ uint64_t Subtract(uint64_t v1, uint64_t v2) { return v1 - v2; }
 // and jumping with InsertIndirectJump sometimes segfaults. Since they are
 // rare, we use full-blown ExecuteAt.
 void SlowJump(ThreadContext* tc) {
+    stats.slowJumps++;
     CONTEXT* ctxt = GetPinCtxt(tc);
     PIN_SetContextReg(ctxt, tcReg, (ADDRINT)tc);
     PIN_SetContextReg(ctxt, tidReg, (ADDRINT)GetContextTid(tc));
+    PIN_SetContextReg(ctxt, undoReg, undoLogging[GetContextTid(tc)]);
     PIN_SetContextReg(ctxt, REG_RIP, (ADDRINT)ReadReg<REG_RIP>(tc));
     PIN_ExecuteAt(ctxt);
 }
@@ -562,11 +723,29 @@ void Instrument(TRACE trace, const TraceInfo& pt) {
     std::map<INS, uint32_t> insToIdx;
     for (uint32_t i = 0; i < traceInstrs; i++) insToIdx[idxToIns[i]] = i;
 
+    uint32_t version = TRACE_Version(trace);
+
     // If the first instruction is a syscall, DO ABSOLUTELY NOTHING.
     // The syscall guard sets the right full context for the syscall, and the
     // trace guard that runs immediately after refreshes the threadContext.
-    // This trace will only run the syscall instruction.
-    if (INS_IsSyscall(idxToIns[0])) return;
+    // This trace will only run the syscall instruction. But leave NOJUMP
+    // versions, as the thread may continue through the next trace in place.
+    if (INS_IsSyscall(idxToIns[0])) {
+        BBL_SetTargetVersion(TRACE_BblHead(trace), version & ~TRACE_VERSION_NOJUMP_BIT);
+        return;
+    }
+
+    bool logsWrites = version & TRACE_VERSION_UNDOLOG_BIT;
+    uint32_t defaultVersion = version & ~TRACE_VERSION_NOJUMP_BIT;
+    uint32_t nojumpVersion = version | TRACE_VERSION_NOJUMP_BIT;
+
+    // Move to the other pair of versions if the thread's undo logging mode
+    // does not match. NOJUMP traces are only reached without switching
+    // threads, so they always match.
+    if (version == defaultVersion) {
+        INS_InsertVersionCase(idxToIns[0], undoReg, !logsWrites,
+                defaultVersion ^ TRACE_VERSION_UNDOLOG_BIT, IARG_END);
+    }
 
     // Find callpoint and switchpoint order
 
@@ -728,8 +907,8 @@ void Instrument(TRACE trace, const TraceInfo& pt) {
         if (switchIPoints[idx].taken_branch.size()) panic("Switchcalls at IPOINT_TAKEN_BRANCH not supported");
         if (switchIPoints[idx].before.size() > 1) panic("Multiple switchcalls per IPOINT not supported");
 
-        // Skip leading switchcall in NOJUMP version
-        bool skipSwitchcall = (idx == 0 && TRACE_Version(trace) != TRACE_VERSION_DEFAULT);
+        // Skip leading switchcall in NOJUMP versions
+        bool skipSwitchcall = (idx == 0 && version != defaultVersion);
 
         if (switchIPoints[idx].before.size() && !skipSwitchcall) {
             IPOINT ipoint = IPOINT_BEFORE;
@@ -738,7 +917,7 @@ void Instrument(TRACE trace, const TraceInfo& pt) {
             INS_InsertCall(idxToIns[idx], ipoint, (AFUNPTR)WriteReg<REG_RIP>, IARG_REG_VALUE, tcReg, IARG_REG_VALUE, REG_RIP, IARG_END);
 
             // Insert switchcall
-            switchIPoints[idx].before[0]();
+            InsertSwitchCall(idxToIns[idx], switchIPoints[idx].before[0]);
 
             // Save whether we should switch to to switchReg. Inlined for performance:
             //  - If NeedsSwitch() returns false, switchReg must have the
@@ -754,16 +933,21 @@ void Instrument(TRACE trace, const TraceInfo& pt) {
                              IARG_END);
             INS_InsertThenCall(idxToIns[idx], ipoint, (AFUNPTR)SwitchHandler,
                                IARG_THREAD_ID, IARG_REG_REFERENCE, tcReg,
+                               IARG_REG_REFERENCE, undoReg,
                                IARG_REG_VALUE, switchReg,
                                IARG_RETURN_REGS, switchReg, IARG_END);
             INS_InsertCall(idxToIns[idx], ipoint, (AFUNPTR)Subtract,
                            IARG_REG_VALUE, tidReg, IARG_REG_VALUE, switchReg,
                            IARG_RETURN_REGS, switchReg, IARG_END);
 
-            // Go to to version 1 if switchReg == 0
-            INS_InsertVersionCase(idxToIns[idx], switchReg, 0, TRACE_VERSION_NOJUMP, IARG_END);
+            // Go to to NOJUMP version if switchReg == 0
+            INS_InsertVersionCase(idxToIns[idx], switchReg, 0, nojumpVersion, IARG_END);
             // NOTE: This wouldn't work if 1->1 transitions just continue through the trace, but that doesn't seem to be the case.
 
+            // Same thread, but it started or stopped undo logging
+            INS_InsertVersionCase(idxToIns[idx], switchReg, SWITCH_MODE_ONLY,
+                    nojumpVersion ^ TRACE_VERSION_UNDOLOG_BIT, IARG_END);
+
             // Otherwise, test failed, load PC and tidReg and do the jump
             if (INS_HasRealRep(idxToIns[idx])) {
                 INS_InsertCall(idxToIns[idx], ipoint, (AFUNPTR)SlowJump, IARG_REG_VALUE, tcReg, IARG_END);
@@ -781,13 +965,20 @@ void Instrument(TRACE trace, const TraceInfo& pt) {
         for (auto& f : callIPoints[idx].before) f();
         for (auto& f : callIPoints[idx].after) f();
         for (auto& f : callIPoints[idx].taken_branch) f();
+
+        // 3. Log writes of speculative threads (after reg reads, which the EA needs)
+        if (logsWrites && INS_IsMemoryWrite(idxToIns[idx])) {
+            INS_InsertPredicatedCall(idxToIns[idx], IPOINT_BEFORE, (AFUNPTR)RecordUndo,
+                    IARG_REG_VALUE, tcReg, IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE,
+                    IARG_CALL_ORDER, CALL_ORDER_FIRST+1, IARG_END);
+        }
     }
 
-    // NOJUMP traces must go back to version 0 by default to avoid missing
+    // NOJUMP traces must go back to the default version to avoid missing
     // switchcalls th the start of the next trace
-    if (TRACE_Version(trace) != TRACE_VERSION_DEFAULT) {
+    if (version != defaultVersion) {
         for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
-            BBL_SetTargetVersion(bbl, TRACE_VERSION_DEFAULT);
+            BBL_SetTargetVersion(bbl, defaultVersion);
         }
     }
 }
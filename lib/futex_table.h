@@ -0,0 +1,107 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef FUTEX_TABLE_H_
+#define FUTEX_TABLE_H_
+
+/* Wait queues of emulated futexes, keyed by address. Waiters are woken in
+ * FIFO order, like the kernel does for non-PI futexes of the same priority.
+ */
+
+#include <deque>
+#include <stdint.h>
+#include <unordered_map>
+#include <vector>
+
+class FutexTable {
+    private:
+        struct Waiter {
+            uint32_t tid;
+            uint32_t bitset;
+        };
+        std::unordered_map<uint64_t, std::deque<Waiter>> queues;
+        std::unordered_map<uint32_t, uint64_t> waitAddrs;  // tid -> addr it waits on
+
+    public:
+        void wait(uint64_t addr, uint32_t tid, uint32_t bitset) {
+            queues[addr].push_back({tid, bitset});
+            waitAddrs[tid] = addr;
+        }
+
+        // Dequeue tid, if waiting (e.g., unblocked by other means); returns
+        // whether it was
+        bool remove(uint32_t tid) {
+            auto wa = waitAddrs.find(tid);
+            if (wa == waitAddrs.end()) return false;
+            auto it = queues.find(wa->second);
+            waitAddrs.erase(wa);
+            auto& q = it->second;
+            for (auto w = q.begin(); w != q.end(); w++) {
+                if (w->tid == tid) {
+                    q.erase(w);
+                    break;
+                }
+            }
+            if (q.empty()) queues.erase(it);
+            return true;
+        }
+
+        // Dequeue up to n waiters whose bitset intersects bitset
+        std::vector<uint32_t> wake(uint64_t addr, uint32_t n, uint32_t bitset) {
+            std::vector<uint32_t> woken;
+            auto it = queues.find(addr);
+            if (it == queues.end()) return woken;
+            auto& q = it->second;
+            for (auto w = q.begin(); w != q.end() && woken.size() < n;) {
+                if (w->bitset & bitset) {
+                    woken.push_back(w->tid);
+                    waitAddrs.erase(w->tid);
+                    w = q.erase(w);
+                } else {
+                    w++;
+                }
+            }
+            if (q.empty()) queues.erase(it);
+            return woken;
+        }
+
+        // Move up to n waiters from addr to addr2; returns how many moved
+        uint32_t requeue(uint64_t addr, uint64_t addr2, uint32_t n) {
+            auto it = queues.find(addr);
+            if (it == queues.end() || addr == addr2) return 0;
+            auto& q = it->second;
+            uint32_t moved = 0;
+            while (!q.empty() && moved < n) {
+                queues[addr2].push_back(q.front());
+                waitAddrs[q.front().tid] = addr2;
+                q.pop_front();
+                moved++;
+            }
+            // NOTE: Inserting addr2 may rehash, which invalidates it (but not q)
+            if (q.empty()) queues.erase(addr);
+            return moved;
+        }
+};
+
+#endif  // FUTEX_TABLE_H_
@@ -0,0 +1,138 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef IO_RING_H_
+#define IO_RING_H_
+
+/* Minimal io_uring wrapper (raw syscalls, no liburing). One thread submits
+ * and one thread reaps; callers serialize submitters and reapers themselves.
+ */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "log.h"
+
+#ifndef __NR_io_uring_setup
+#define __NR_io_uring_setup 425
+#define __NR_io_uring_enter 426
+#endif
+
+class IoRing {
+    private:
+        int fd = -1;
+        uint32_t sqEntries = 0;
+
+        uint32_t* sqHead;
+        uint32_t* sqTail;
+        uint32_t* sqMask;
+        uint32_t* sqArray;
+        io_uring_sqe* sqes;
+
+        uint32_t* cqHead;
+        uint32_t* cqTail;
+        uint32_t* cqMask;
+        io_uring_cqe* cqes;
+
+    public:
+        // Returns false if io_uring is unavailable, or lacks requiredFeatures
+        bool init(uint32_t entries, uint32_t requiredFeatures) {
+            io_uring_params p;
+            memset(&p, 0, sizeof(p));
+            int ringFd = syscall(__NR_io_uring_setup, entries, &p);
+            if (ringFd < 0) return false;
+            if ((p.features & requiredFeatures) != requiredFeatures ||
+                    !(p.features & IORING_FEAT_SINGLE_MMAP)) {
+                close(ringFd);
+                return false;
+            }
+
+            // With SINGLE_MMAP, the SQ and CQ rings share one mapping
+            size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+            size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+            size_t ringSize = (sqSize > cqSize)? sqSize : cqSize;
+            uint8_t* ring = (uint8_t*)mmap(nullptr, ringSize, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+            void* sqeMem = mmap(nullptr, p.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+            if (ring == MAP_FAILED || sqeMem == MAP_FAILED) {
+                close(ringFd);
+                return false;
+            }
+
+            sqHead = (uint32_t*)(ring + p.sq_off.head);
+            sqTail = (uint32_t*)(ring + p.sq_off.tail);
+            sqMask = (uint32_t*)(ring + p.sq_off.ring_mask);
+            sqArray = (uint32_t*)(ring + p.sq_off.array);
+            sqes = (io_uring_sqe*)sqeMem;
+            cqHead = (uint32_t*)(ring + p.cq_off.head);
+            cqTail = (uint32_t*)(ring + p.cq_off.tail);
+            cqMask = (uint32_t*)(ring + p.cq_off.ring_mask);
+            cqes = (io_uring_cqe*)(ring + p.cq_off.cqes);
+            sqEntries = p.sq_entries;
+            fd = ringFd;
+            return true;
+        }
+
+        int getFd() const { return fd; }
+        uint32_t capacity() const { return sqEntries; }
+
+        // Queues sqe and submits it. Returns false, without queuing, if the
+        // submission queue is full. Returns true once the kernel took it.
+        bool submit(const io_uring_sqe& sqe) {
+            uint32_t tail = *sqTail;
+            if (tail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) return false;
+            uint32_t idx = tail & *sqMask;
+            sqes[idx] = sqe;
+            sqArray[idx] = idx;
+            __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+            // The kernel keeps unconsumed entries for the next enter, so retry
+            // transient failures until it takes this one
+            long res;
+            do {
+                res = syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0);
+            } while (res == 0 || (res < 0 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)));
+            if (res < 0) panic("io_uring_enter() failed (errno %d)", errno);
+            return true;
+        }
+
+        // Calls handler(user_data, res) on each completion; returns how many
+        uint32_t reap(void (*handler)(uint64_t userData, int32_t res)) {
+            uint32_t head = *cqHead;
+            uint32_t tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+            for (uint32_t h = head; h != tail; h++) {
+                const io_uring_cqe& cqe = cqes[h & *cqMask];
+                handler(cqe.user_data, cqe.res);
+            }
+            __atomic_store_n(cqHead, tail, __ATOMIC_RELEASE);
+            return tail - head;
+        }
+};
+
+#endif  // IO_RING_H_
@@ -31,6 +31,7 @@
 #include <stdint.h>
 #include <syscall.h>
 #include <unistd.h>
+#include <x86intrin.h>
 #include <xmmintrin.h>
 
 typedef volatile uint32_t lock_t;
@@ -111,4 +112,218 @@ static inline bool futex_haswaiters(volatile uint32_t* lock) {
     return *lock == 2;
 }
 
+/* Directed token: like a lock, but the holder can pass it to a specific
+ * owner. 0 means free; any other value is the id of the owner. Meant to be
+ * placed in shared memory and used by a handful of processes, so passes wake
+ * all waiters and let them check whether the token is theirs.
+ */
+static inline void futex_token_acquire(volatile uint32_t* token, uint32_t id) {
+    while (true) {
+        for (int i = 0; i < 1000; i++) {
+            uint32_t c = *token;
+            if (c == id) return;
+            if (c == 0 && __sync_bool_compare_and_swap(token, 0, id)) return;
+            _mm_pause();
+        }
+        uint32_t c = *token;
+        if (c == id) return;
+        if (c == 0) continue;
+        syscall(SYS_futex, token, FUTEX_WAIT, c, NULL, NULL, 0);
+    }
+}
+
+// Pass to id, or release if id == 0. Caller must hold the token.
+static inline void futex_token_pass(volatile uint32_t* token, uint32_t id) {
+    __sync_lock_test_and_set(token, id);
+    syscall(SYS_futex, token, FUTEX_WAKE, 0x7fffffff /*wake all*/, NULL, NULL, 0);
+}
+
+/* Optional per-lock counters. Updated only by the lock holder, so they need
+ * no atomics. Wait cycles are TSC cycles spent acquiring contended locks.
+ */
+typedef struct {
+    uint64_t acquires;
+    uint64_t contended;
+    uint64_t waitCycles;
+} lock_stats_t;
+
+static inline void lock_stats_record(lock_stats_t* stats, uint64_t waitStart) {
+    if (!stats) return;
+    stats->acquires++;
+    if (waitStart) {
+        stats->contended++;
+        stats->waitCycles += __rdtsc() - waitStart;
+    }
+}
+
+/* Fair (FIFO) ticket lock. Unlike the MCS lock below, it needs no queue
+ * node per acquirer, but all waiters read the shared serving count. Waiters
+ * spin on it for a while, then sleep on it with a futex bitset derived from
+ * their ticket, so each release wakes only the next few tickets' sleepers
+ * instead of all of them.
+ */
+typedef struct {
+    volatile uint32_t next;
+    volatile uint32_t serving;
+} ticket_lock_t;
+
+static inline void ticket_init(ticket_lock_t* lock) {
+    lock->next = 0;
+    lock->serving = 0;
+    __sync_synchronize();
+}
+
+static inline uint32_t ticket_bitset(uint32_t ticket) {
+    return 1u << (ticket % 32);
+}
+
+static inline void ticket_lock(ticket_lock_t* lock, lock_stats_t* stats) {
+    uint32_t ticket = __sync_fetch_and_add(&lock->next, 1);
+    uint32_t serving = lock->serving;
+    if (serving == ticket) {
+        lock_stats_record(stats, 0);
+        return;
+    }
+
+    uint64_t waitStart = __rdtsc();
+    while (serving != ticket) {
+        // Spin only when next in line; waiters further back would burn
+        // cycles the holder and the next waiter may need
+        for (int i = 0; i < 1000 && ticket - serving == 1; i++) {
+            _mm_pause();
+            serving = lock->serving;
+        }
+        if (serving == ticket) break;
+        syscall(SYS_futex, &lock->serving, FUTEX_WAIT_BITSET, serving, NULL, NULL, ticket_bitset(ticket));
+        serving = lock->serving;
+    }
+    lock_stats_record(stats, waitStart);
+}
+
+static inline void ticket_unlock(ticket_lock_t* lock) {
+    uint32_t next = __sync_add_and_fetch(&lock->serving, 1);
+    // Someone may be waiting (possibly asleep)
+    if (lock->next != next) {
+        syscall(SYS_futex, &lock->serving, FUTEX_WAKE_BITSET, 0x7fffffff, NULL, NULL, ticket_bitset(next));
+    }
+}
+
+static inline bool ticket_haswaiters(ticket_lock_t* lock) {
+    return lock->next - lock->serving > 1;
+}
+
+/* Adaptive spin lock: futex_lock, but it spins up to about twice as long as
+ * recent contended acquisitions took to succeed by spinning (like glibc's
+ * adaptive mutexes), instead of a fixed 1000 iterations.
+ */
+typedef struct {
+    volatile uint32_t futex;
+    uint32_t spinEstimate;  // updated by holders only
+} adaptive_lock_t;
+
+#define ADAPTIVE_MAX_SPINS 8192
+
+static inline void adaptive_init(adaptive_lock_t* lock) {
+    lock->futex = 0;
+    lock->spinEstimate = 100;
+    __sync_synchronize();
+}
+
+static inline void adaptive_lock(adaptive_lock_t* lock, lock_stats_t* stats) {
+    if (lock->futex == 0 && __sync_bool_compare_and_swap(&lock->futex, 0, 1)) {
+        lock_stats_record(stats, 0);
+        return;
+    }
+
+    uint64_t waitStart = __rdtsc();
+    uint32_t maxSpins = 2 * lock->spinEstimate + 10;
+    if (maxSpins > ADAPTIVE_MAX_SPINS) maxSpins = ADAPTIVE_MAX_SPINS;
+    uint32_t spins = 0;
+    for (; spins < maxSpins; spins++) {
+        if (lock->futex == 0 && __sync_bool_compare_and_swap(&lock->futex, 0, 1)) break;
+        _mm_pause();
+    }
+    // Racy read-modify-write of the estimate is fine, it's only a hint
+    lock->spinEstimate += ((int32_t)spins - (int32_t)lock->spinEstimate) / 8;
+    if (spins < maxSpins) {
+        lock_stats_record(stats, waitStart);
+        return;
+    }
+
+    // Block, as in futex_lock
+    uint32_t c = __sync_lock_test_and_set(&lock->futex, 2);
+    while (c != 0) {
+        syscall(SYS_futex, &lock->futex, FUTEX_WAIT, 2, NULL, NULL, 0);
+        c = __sync_lock_test_and_set(&lock->futex, 2);
+    }
+    lock_stats_record(stats, waitStart);
+}
+
+static inline void adaptive_unlock(adaptive_lock_t* lock) {
+    futex_unlock(&lock->futex);
+}
+
+static inline bool adaptive_haswaiters(adaptive_lock_t* lock) {
+    return futex_haswaiters(&lock->futex);
+}
+
+/* MCS queue lock (Mellor-Crummey and Scott). Each acquirer appends its own
+ * node to the queue and waits on it, so waiters do not share a cache line,
+ * and a release touches only the successor's node (FIFO). The node must stay
+ * untouched until the matching release. Waiters spin for a while, then
+ * sleep on their node's futex word.
+ */
+#define MCS_GRANTED 0
+#define MCS_SPINNING 1
+#define MCS_SLEEPING 2
+
+typedef struct mcs_node {
+    struct mcs_node* volatile next;
+    volatile uint32_t wait;
+} mcs_node_t;
+
+typedef struct {
+    mcs_node_t* volatile tail;
+} mcs_lock_t;
+
+static inline void mcs_init(mcs_lock_t* lock) {
+    lock->tail = NULL;
+    __sync_synchronize();
+}
+
+static inline void mcs_lock(mcs_lock_t* lock, mcs_node_t* node, lock_stats_t* stats) {
+    node->next = NULL;
+    node->wait = MCS_SPINNING;
+    mcs_node_t* pred = __atomic_exchange_n(&lock->tail, node, __ATOMIC_SEQ_CST);
+    if (!pred) {
+        lock_stats_record(stats, 0);
+        return;
+    }
+
+    uint64_t waitStart = __rdtsc();
+    pred->next = node;
+    for (int i = 0; i < 1000 && node->wait == MCS_SPINNING; i++) _mm_pause();
+    // If the CAS fails, the predecessor granted us the lock meanwhile
+    __sync_bool_compare_and_swap(&node->wait, MCS_SPINNING, MCS_SLEEPING);
+    while (node->wait == MCS_SLEEPING) {
+        syscall(SYS_futex, &node->wait, FUTEX_WAIT, MCS_SLEEPING, NULL, NULL, 0);
+    }
+    lock_stats_record(stats, waitStart);
+}
+
+static inline void mcs_unlock(mcs_lock_t* lock, mcs_node_t* node) {
+    mcs_node_t* succ = node->next;
+    if (!succ) {
+        if (__sync_bool_compare_and_swap(&lock->tail, node, NULL)) return;
+        // Someone swapped in the tail and is about to link itself behind us
+        while (!(succ = node->next)) _mm_pause();
+    }
+    uint32_t prev = __atomic_exchange_n(&succ->wait, MCS_GRANTED, __ATOMIC_SEQ_CST);
+    if (prev == MCS_SLEEPING) syscall(SYS_futex, &succ->wait, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static inline bool mcs_haswaiters(mcs_lock_t* lock, mcs_node_t* holder) {
+    return holder && (holder->next || lock->tail != holder);
+}
+
 #endif  // LOCKS_H_
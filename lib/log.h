@@ -27,9 +27,9 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include "mutex.h"
+#include "spin_mutex.h"
 
-extern mutex logMutex;
+extern spin_mutex logMutex;
 
 static inline void info(const char* str) {
     scoped_mutex sm(logMutex);
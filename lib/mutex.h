@@ -34,19 +34,100 @@ class mutex {
     public:
         mutex() { futex_init(&futex); }
         void lock() { futex_lock(&futex); }
+        bool trylock() { return futex_trylock_nospin_timeout(&futex, 0); }
         void unlock() { futex_unlock(&futex); }
         bool haswaiters() { return futex_haswaiters(&futex); }
 };
 
 class aligned_mutex : public mutex {} ATTR_LINE_ALIGNED;
 
+/* Alternatives to mutex, with the same interface. Each can track
+ * lock_stats_t counters, which trackStats() enables (null disables them).
+ */
+
+class ticket_mutex {
+    private:
+        ticket_lock_t tl;
+        lock_stats_t* stats;
+    public:
+        ticket_mutex() : stats(nullptr) { ticket_init(&tl); }
+        void lock() { ticket_lock(&tl, stats); }
+        void unlock() { ticket_unlock(&tl); }
+        bool haswaiters() { return ticket_haswaiters(&tl); }
+        void trackStats(lock_stats_t* s) { stats = s; }
+};
+
+class adaptive_mutex {
+    private:
+        adaptive_lock_t al;
+        lock_stats_t* stats;
+    public:
+        adaptive_mutex() : stats(nullptr) { adaptive_init(&al); }
+        void lock() { adaptive_lock(&al, stats); }
+        void unlock() { adaptive_unlock(&al); }
+        bool haswaiters() { return adaptive_haswaiters(&al); }
+        void trackStats(lock_stats_t* s) { stats = s; }
+};
+
+// MCS lock with one queue node per thread, picked by nodeId() (which must
+// return ids below NODES). The holder's node is recorded, so any thread may
+// release the lock.
+template <uint32_t NODES, uint32_t (*nodeId)()>
+class mcs_mutex {
+    private:
+        struct aligned_node : mcs_node_t {} ATTR_LINE_ALIGNED;
+        mcs_lock_t ml;
+        mcs_node_t* holder;
+        lock_stats_t* stats;
+        aligned_node nodes[NODES];
+    public:
+        mcs_mutex() : holder(nullptr), stats(nullptr) { mcs_init(&ml); }
+        void lock() {
+            mcs_node_t* node = &nodes[nodeId()];
+            mcs_lock(&ml, node, stats);
+            holder = node;
+        }
+        void unlock() {
+            mcs_node_t* node = holder;
+            holder = nullptr;
+            mcs_unlock(&ml, node);
+        }
+        bool haswaiters() { return mcs_haswaiters(&ml, holder); }
+        void trackStats(lock_stats_t* s) { stats = s; }
+};
+
+// mutex with counters (futex_lock itself does not track them)
+class tracked_mutex : public mutex {
+    private:
+        lock_stats_t* stats;
+    public:
+        tracked_mutex() : stats(nullptr) {}
+        void lock() {
+            if (!stats) {
+                mutex::lock();
+            } else if (!mutex::trylock()) {
+                uint64_t waitStart = __rdtsc();
+                mutex::lock();
+                lock_stats_record(stats, waitStart);
+            } else {
+                lock_stats_record(stats, 0);
+            }
+        }
+        void trackStats(lock_stats_t* s) { stats = s; }
+};
+
+// Works with mutex and any of the alternatives above
 class scoped_mutex {
     private:
-        mutex* mut;
+        void* mut;
+        void (*unlockFn)(void*);
     public:
-        scoped_mutex(mutex& _mut) : mut(&_mut) { mut->lock(); }
-        scoped_mutex() : mut(0) {}
-        ~scoped_mutex() { if (mut) mut->unlock(); }
+        template <typename M>
+        scoped_mutex(M& _mut) : mut(&_mut), unlockFn([](void* m) { static_cast<M*>(m)->unlock(); }) {
+            _mut.lock();
+        }
+        scoped_mutex() : mut(0), unlockFn(0) {}
+        ~scoped_mutex() { if (mut) unlockFn(mut); }
 };
 
 #endif /*__MUTEX_H__*/
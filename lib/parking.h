@@ -0,0 +1,115 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARKING_H_
+#define PARKING_H_
+
+/* Per-thread parking slots for executor handoffs. A waker posts a token (why
+ * the thread is woken) to the target's slot, and the parked thread spins for
+ * a while before sleeping on the slot's futex, so wakers make a syscall only
+ * when the target is actually asleep. Each slot adapts how long it spins to
+ * how soon its tokens arrive.
+ */
+
+#include <linux/futex.h>
+#include <stdint.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <x86intrin.h>
+
+#include "pad.h"
+
+class ParkingSlot {
+    private:
+        enum { EMPTY = 0, SLEEPING = 1 };  // other values are posted tokens
+
+        static const uint32_t MIN_SPINS = 64;
+        static const uint32_t MAX_SPINS = 16384;
+        static const uint32_t INIT_SPINS = 1000;  // like futex_lock
+
+        volatile uint32_t word;
+        uint32_t spinLimit;  // only changed by the parked thread
+        volatile uint64_t postCycle;  // TSC when the token was posted
+
+    public:
+        static const uint32_t FIRST_TOKEN = 2;
+
+        ParkingSlot() : word(EMPTY), spinLimit(INIT_SPINS), postCycle(0) {}
+
+        // Posts token (>= FIRST_TOKEN), replacing any token not taken yet
+        void unpark(uint32_t token) {
+            postCycle = __rdtsc();
+            if (__sync_lock_test_and_set(&word, token) == SLEEPING) {
+                syscall(SYS_futex, &word, FUTEX_WAKE, 1, NULL, NULL, 0);
+            }
+        }
+
+        // Waits for a token and takes it. Sets latency to the TSC cycles
+        // since the token was posted.
+        uint32_t park(uint64_t* latency) {
+            uint64_t start = __rdtsc();
+            for (uint32_t spins = 0; spins < spinLimit; spins++) {
+                if (word >= FIRST_TOKEN) {
+                    // Spinning paid off; aim for about twice what it took
+                    uint32_t target = 2 * spins;
+                    spinLimit = (7 * spinLimit + ((target > MIN_SPINS)? target : MIN_SPINS)) / 8;
+                    return take(latency);
+                }
+                _mm_pause();
+            }
+
+            uint64_t spinEnd = __rdtsc();
+            while (true) {
+                uint32_t w = word;
+                if (w >= FIRST_TOKEN) break;
+                if (w == EMPTY && !__sync_bool_compare_and_swap(&word, EMPTY, SLEEPING)) continue;
+                syscall(SYS_futex, &word, FUTEX_WAIT, SLEEPING, NULL, NULL, 0);
+            }
+
+            // If the token came soon after we gave up, spinning longer would
+            // have saved both futex syscalls; if it came much later, spinning
+            // was wasted
+            uint64_t slept = __rdtsc() - spinEnd;
+            if (slept < spinEnd - start) {
+                spinLimit = (2 * spinLimit < MAX_SPINS)? 2 * spinLimit : MAX_SPINS;
+            } else {
+                spinLimit = (spinLimit / 2 > MIN_SPINS)? spinLimit / 2 : MIN_SPINS;
+            }
+            return take(latency);
+        }
+
+        // Drops any posted token (e.g., in a forked child)
+        void reset() {
+            word = EMPTY;
+        }
+
+    private:
+        uint32_t take(uint64_t* latency) {
+            uint32_t token = __sync_lock_test_and_set(&word, EMPTY);
+            *latency = __rdtsc() - postCycle;
+            return token;
+        }
+} ATTR_LINE_ALIGNED;
+
+#endif  // PARKING_H_
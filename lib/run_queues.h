@@ -0,0 +1,120 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef RUN_QUEUES_H_
+#define RUN_QUEUES_H_
+
+/* FIFO run queues of ids (thread ids), one per virtual core. Each id has a
+ * home queue, and sits in at most one queue at a time. Lists are intrusive,
+ * over per-id arrays, so push, remove, and moving an id to another home are
+ * all O(1).
+ */
+
+#include <stdint.h>
+#include <vector>
+
+class RunQueues {
+    public:
+        static const uint32_t NONE = -1u;
+
+    private:
+        std::vector<uint32_t> heads;
+        std::vector<uint32_t> tails;
+        std::vector<uint32_t> lengths;
+        std::vector<uint32_t> next;
+        std::vector<uint32_t> prev;
+        std::vector<uint32_t> queues;  // queue each id is in, or NONE
+        std::vector<uint32_t> homes;  // home queue of each id, or NONE if unassigned
+
+        void append(uint32_t id, uint32_t q) {
+            next[id] = NONE;
+            prev[id] = tails[q];
+            if (tails[q] != NONE) next[tails[q]] = id;
+            else heads[q] = id;
+            tails[q] = id;
+            lengths[q]++;
+            queues[id] = q;
+        }
+
+        void unlink(uint32_t id) {
+            uint32_t q = queues[id];
+            if (prev[id] != NONE) next[prev[id]] = next[id];
+            else heads[q] = next[id];
+            if (next[id] != NONE) prev[next[id]] = prev[id];
+            else tails[q] = prev[id];
+            lengths[q]--;
+            queues[id] = NONE;
+        }
+
+    public:
+        // +NONE passes a copy: vectors take values by reference, and binding
+        // one to NONE would need an out-of-class definition at -O0
+        explicit RunQueues(uint32_t maxIds)
+            : next(maxIds), prev(maxIds), queues(maxIds, +NONE), homes(maxIds, +NONE) {}
+
+        // Sets the number of queues and clears them; homes outside the new
+        // range are reassigned on the next push
+        void resize(uint32_t numQueues) {
+            heads.assign(numQueues, +NONE);
+            tails.assign(numQueues, +NONE);
+            lengths.assign(numQueues, 0);
+            for (uint32_t id = 0; id < queues.size(); id++) {
+                queues[id] = NONE;
+                if (homes[id] >= numQueues) homes[id] = NONE;
+            }
+        }
+
+        uint32_t size() const { return heads.size(); }
+        bool queued(uint32_t id) const { return queues[id] != NONE; }
+        uint32_t length(uint32_t q) const { return lengths[q]; }
+        uint32_t front(uint32_t q) const { return heads[q]; }
+        uint32_t back(uint32_t q) const { return tails[q]; }
+
+        // Unassigned ids get a home spread by id
+        uint32_t home(uint32_t id) {
+            if (homes[id] == NONE) homes[id] = id % size();
+            return homes[id];
+        }
+
+        // Moves id to the back of its new home queue if it was queued
+        void setHome(uint32_t id, uint32_t q) {
+            homes[id] = q;
+            if (queued(id) && queues[id] != q) {
+                unlink(id);
+                append(id, q);
+            }
+        }
+
+        // Appends id to its home queue; no-op if already queued
+        void push(uint32_t id) {
+            if (!queued(id)) append(id, home(id));
+        }
+
+        void remove(uint32_t id) {
+            if (queued(id)) unlink(id);
+        }
+};
+
+#endif  // RUN_QUEUES_H_
@@ -0,0 +1,110 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SCHEDULE_LOG_H_
+#define SCHEDULE_LOG_H_
+
+/* Compact on-disk format for recorded schedules. Each event is two LEB128
+ * varints: (delta << 3 | type) and tid, where delta is the number of
+ * switchpoints the executor ran since the previous event.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <vector>
+
+#include "log.h"
+
+enum ScheduleEventType : uint8_t {
+    EV_SWITCH,        // switchcall returned tid
+    EV_SWITCH_BLOCK,  // same, and the running thread blocked
+    EV_UNCAPTURE,     // running thread uncaptured, switch to tid
+    EV_CAPTURE,       // tid captured
+    EV_BLOCK,         // idle tid blocked
+    EV_UNBLOCK,       // tid unblocked
+    EV_EXEC_RETURN,   // executor returned from a syscall without being uncaptured
+    EV_FUTEX_WAIT,    // running thread blocked on an emulated futex, switch to tid
+    EV_NUM_TYPES,
+};
+
+struct ScheduleEvent {
+    uint64_t delta;
+    uint32_t tid;
+    ScheduleEventType type;
+};
+
+class ScheduleWriter {
+    private:
+        FILE* file;
+
+        void writeVarint(uint64_t v) {
+            while (v >= 0x80) {
+                fputc((v & 0x7f) | 0x80, file);
+                v >>= 7;
+            }
+            fputc(v, file);
+        }
+
+    public:
+        explicit ScheduleWriter(const char* path) {
+            file = fopen(path, "wb");
+            if (!file) panic("Could not open schedule file %s for writing", path);
+        }
+
+        void write(const ScheduleEvent& ev) {
+            writeVarint((ev.delta << 3) | ev.type);
+            writeVarint(ev.tid);
+        }
+
+        void flush() { fflush(file); }
+};
+
+static inline std::vector<ScheduleEvent> ReadSchedule(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) panic("Could not open schedule file %s", path);
+
+    auto readVarint = [&](uint64_t& v) -> bool {
+        v = 0;
+        for (uint32_t shift = 0; shift < 64; shift += 7) {
+            int c = fgetc(file);
+            if (c == EOF) return false;
+            v |= ((uint64_t)(c & 0x7f)) << shift;
+            if (!(c & 0x80)) return true;
+        }
+        return false;
+    };
+
+    std::vector<ScheduleEvent> events;
+    uint64_t head, tid;
+    while (readVarint(head)) {
+        if (!readVarint(tid) || (head & 0x7) >= EV_NUM_TYPES) {
+            panic("Corrupt schedule file %s (event %ld)", path, events.size());
+        }
+        events.push_back({head >> 3, (uint32_t)tid, (ScheduleEventType)(head & 0x7)});
+    }
+    fclose(file);
+    return events;
+}
+
+#endif  // SCHEDULE_LOG_H_
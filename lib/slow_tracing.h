@@ -39,7 +39,9 @@
  * trailing switch handler uses SLOW PIN_ExecuteAt to switch to it.
  *
  * To support setReg(), the Pin context is saved wholesale before every
- * switchcall.
+ * switchcall that takes the context. Other switchcalls can't see it, so the
+ * switch handler saves it only if the thread is actually switched out, from
+ * the context Pin passes it.
  */
 
 namespace spin {
@@ -55,8 +57,17 @@ CONTEXT* GetPinCtxt(ThreadContext* tc) {
     return (CONTEXT*)tc;
 }
 
+uint32_t GetContextTid(const ThreadContext* tc) {
+    return (const CONTEXT*)tc - contexts.data();
+}
+
+// Whether a saved context was changed since InitContext() (see
+// CanResumeInPlace())
+std::array<bool, MAX_THREADS> contextChanged;
+
 void InitContext(const CONTEXT* ctxt, ThreadContext* tc) {
     PIN_SaveContext(ctxt, GetPinCtxt(tc));
+    contextChanged[GetContextTid(tc)] = false;
 }
 
 void CoalesceContext(const CONTEXT* ctxt, ThreadContext* tc) {
@@ -68,6 +79,79 @@ void UpdatePinContext(ThreadContext* tc) {
     // Fast mode copies all regs to the pin context
 }
 
+/* Guard support. The tid reg of a saved context tells whether it is live (see
+ * setReg()), so it must be -1 while the thread is out in a syscall. Guards
+ * switch full contexts in, unless the thread resumes its own unchanged one.
+ */
+void SetToolRegs(CONTEXT* ctxt, ThreadId tid, bool isSyscall) {
+    PIN_SetContextReg(ctxt, tcReg, (ADDRINT)(isSyscall? nullptr : GetTC(tid)));
+    PIN_SetContextReg(ctxt, tidReg, isSyscall? -1 : tid);
+    PIN_SetContextReg(ctxt, undoReg, !isSyscall && undoLogging[tid]);
+}
+
+void ClearSyscallPc(ThreadId tid) {}  // InitContext() always saves it all
+
+// The guard's ctxt is the thread's actual state, so if its saved copy is
+// unchanged since the guard saved it, the thread can continue through the
+// trace. Only the tool regs need fixing (see InsertGuardResume()).
+bool CanResumeInPlace(ThreadId tid, const CONTEXT* ctxt, ADDRINT resumePc) {
+    return !contextChanged[tid] && PIN_GetContextReg(GetPinCtxt(GetTC(tid)), REG_RIP) == resumePc;
+}
+
+// Mark the saved context live, as switching to it would
+void ResumeInPlace(ThreadId tid) {
+    CONTEXT* pinCtxt = GetPinCtxt(GetTC(tid));
+    PIN_SetContextReg(pinCtxt, tcReg, (ADDRINT)GetTC(tid));
+    PIN_SetContextReg(pinCtxt, tidReg, tid);
+}
+
+uint64_t ResumedWithSyscallTid(uint64_t tid) {
+    return tid == -1ul;
+}
+
+uint64_t ResumedTid(ThreadContext* tc) {
+    return GetContextTid(tc);
+}
+
+// After an in-place resume, tidReg still has the -1 of the syscall
+void InsertGuardResume(INS ins) {
+    INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)ResumedWithSyscallTid,
+            IARG_REG_VALUE, tidReg,
+            IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
+    INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)ResumedTid,
+            IARG_REG_VALUE, tcReg, IARG_RETURN_REGS, tidReg,
+            IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
+}
+
+bool LoadSyscallContext(ThreadId tid, CONTEXT* ctxt) {
+    return false;
+}
+
+void InsertSyscallGuard(INS ins, AFUNPTR guard) {
+    INS_InsertThenCall(ins, IPOINT_BEFORE, guard,
+            IARG_THREAD_ID, IARG_CONST_CONTEXT,
+            IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
+}
+
+/* Checkpoints: the whole context, as it's what we have */
+typedef CONTEXT ContextCheckpoint;
+
+void SaveCheckpoint(ThreadContext* tc, ContextCheckpoint* ckpt) {
+    PIN_SaveContext(GetPinCtxt(tc), ckpt);
+}
+
+void RestoreCheckpoint(ThreadContext* tc, const ContextCheckpoint* ckpt) {
+    // Keep the tool regs, which say whether this is the live context
+    CONTEXT* pinCtxt = GetPinCtxt(tc);
+    ADDRINT tcVal = PIN_GetContextReg(pinCtxt, tcReg);
+    uint32_t tid = PIN_GetContextReg(pinCtxt, tidReg);
+    PIN_SaveContext(ckpt, pinCtxt);
+    PIN_SetContextReg(pinCtxt, tcReg, tcVal);
+    PIN_SetContextReg(pinCtxt, tidReg, tid);
+    contextChanged[GetContextTid(tc)] = true;
+    if (tid != -1u) NotifySetLiveReg();
+}
+
 /* Public context functions */
 uint64_t getReg(const ThreadContext* tc, REG reg) {
     return PIN_GetContextReg((const CONTEXT*)tc, reg);
@@ -75,6 +159,7 @@ uint64_t getReg(const ThreadContext* tc, REG reg) {
 
 void setReg(ThreadContext* tc, REG reg, uint64_t val) {
     PIN_SetContextReg((CONTEXT*)tc, reg, val);
+    contextChanged[GetContextTid(tc)] = true;
     uint32_t tid = PIN_GetContextReg((CONTEXT*)tc, tidReg);
     if (tid != -1u) {
         // This is the live context
@@ -84,8 +169,31 @@ void setReg(ThreadContext* tc, REG reg, uint64_t val) {
 }
 
 /* Instrumentation */
-void SwitchHandler(THREADID tid, ThreadContext* tc, uint64_t nextTid) {
-    RecordSwitch(tid, tc, nextTid);
+
+// Set while a switchcall that does not take the context runs, as the running
+// thread's registers are not saved then (see CheckContextSaved())
+bool unsavedSwitchcall = false;
+
+void SetUnsavedSwitchcall(bool unsaved) {
+    unsavedSwitchcall = unsaved;
+}
+
+// The running thread's registers while RecordSwitch runs for a switch that
+// did not save them and does not jump (see SwitchHandler()). Callbacks run
+// meanwhile (e.g., captureCallback, when the switch drains the capture
+// queue) save them on first use (see CheckContextSaved()).
+const CONTEXT* pendingContext = nullptr;
+
+void SwitchHandler(THREADID tid, ThreadContext* tc, uint64_t nextTid, const CONTEXT* ctxt, bool saved) {
+    // Switches that keep the same thread and only change its undo logging
+    // mode (checked from the per-thread flag) or drain the capture queue need
+    // no ExecuteAt
+    bool noJump = IsUndoModeSwitch(nextTid) || IsCaptureOnlySwitch(nextTid);
+    if (!saved && !noJump) InitContext(ctxt, tc);
+    if (!saved && noJump) pendingContext = ctxt;
+    nextTid = RecordSwitch(tid, tc, nextTid);
+    pendingContext = nullptr;
+    if (noJump) return;
 
     CONTEXT* pinCtxt = GetPinCtxt(tc);
     PIN_SetContextReg(pinCtxt, tcReg, (ADDRINT)nullptr);
@@ -101,18 +209,40 @@ void SwitchHandler(THREADID tid, ThreadContext* tc, uint64_t nextTid) {
     PIN_ExecuteAt(nextPinCtxt);
 }
 
+// tid comes from tidReg, which is -1 while the thread is out in a syscall
+// (see SetToolRegs), e.g., for writes in the stutters around the guard
+bool IsUndoLogging(uint32_t tid) {
+    return tid < MAX_THREADS && undoLogging[tid];
+}
+
+void RecordUndo(uint32_t tid, ADDRINT addr, UINT32 size) {
+    undoLogs[tid].record(addr, size);
+}
+
 void Instrument(TRACE trace, const TraceInfo& pt) {
     INS firstIns = BBL_InsHead(TRACE_BblHead(trace));
 
+    // Log memory writes of speculative threads. Without trace versions, every
+    // write checks the thread's flag.
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            if (!INS_IsMemoryWrite(ins)) continue;
+            if (ins == firstIns && INS_IsSyscall(ins)) continue;
+            INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)IsUndoLogging,
+                    IARG_REG_VALUE, tidReg, IARG_END);
+            INS_InsertThenPredicatedCall(ins, IPOINT_BEFORE, (AFUNPTR)RecordUndo,
+                    IARG_REG_VALUE, tidReg,
+                    IARG_MEMORYWRITE_EA, IARG_MEMORYWRITE_SIZE, IARG_END);
+        }
+    }
+
     // Add switchcalls and switch handlers
-    // NOTE: For now, this is just a post-handler, but if we find we need to
-    // modify the context in the switchcall (e.g., write arguments etc), we can
-    // save the context first, pass our internal copy to the switchcall, then
-    // run ExecuteAt.
-    for (auto iip : pt.switchpoints) {
+    for (uint32_t i = 0; i < pt.switchpoints.size(); i++) {
+        auto& iip = pt.switchpoints[i];
         INS ins = std::get<0>(iip);
         IPOINT ipoint = std::get<1>(iip);
         std::function<void()> ifun = std::get<2>(iip);
+        bool saved = pt.switchpointContexts[i];
         if (ipoint != IPOINT_BEFORE) {
             // We can probably do AFTER and TAKEN_BRANCH in slow mode, but
             // they're difficult to do in fast mode.
@@ -120,11 +250,19 @@ void Instrument(TRACE trace, const TraceInfo& pt) {
         }
 
         if (ins == firstIns && ipoint == IPOINT_BEFORE && INS_IsSyscall(ins)) continue;
-        // First, save the context
-        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)InitContext,
-                IARG_CONST_CONTEXT, IARG_REG_VALUE, tcReg, IARG_END);
+        // First, save the context if the switchcall can see it
+        if (saved) {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)InitContext,
+                    IARG_CONST_CONTEXT, IARG_REG_VALUE, tcReg, IARG_END);
+        }
         // Then, run the switchcall...
-        ifun();
+        if (!saved) {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)SetUnsavedSwitchcall, IARG_BOOL, true, IARG_END);
+        }
+        InsertSwitchCall(ins, ifun);
+        if (!saved) {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)SetUnsavedSwitchcall, IARG_BOOL, false, IARG_END);
+        }
         // ...then the switch handler
         INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)NeedsSwitch,
                 IARG_REG_VALUE, tidReg,
@@ -132,7 +270,8 @@ void Instrument(TRACE trace, const TraceInfo& pt) {
         INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)SwitchHandler,
                 IARG_THREAD_ID,
                 IARG_REG_VALUE, tcReg,
-                IARG_REG_VALUE, switchReg, IARG_END);
+                IARG_REG_VALUE, switchReg,
+                IARG_CONST_CONTEXT, IARG_BOOL, saved, IARG_END);
     }
 
 
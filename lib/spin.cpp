@@ -35,38 +35,89 @@
 #include <iostream>
 #include <set>
 #include <map>
+#include <new>
+#include <numeric>
+#include <unordered_map>
 #include <sstream>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "mutex.h"
 #include "assert.h"
+#include "futex_table.h"
+#include "io_ring.h"
 #include "spin.h"
 #include "log.h"
+#include "parking.h"
+#include "schedule_log.h"
+#include "state_bitmaps.h"
+#include "run_queues.h"
+#include "timer_wheel.h"
+#include "undo_log.h"
 
-mutex logMutex; // FIXME: To log.cpp
+spin_mutex logMutex; // FIXME: To log.cpp
 
 // Switches are very frequent... comment unless you're explicitly debugging them
 #define DEBUG(args...) //info(args)
 #define DEBUG_SWITCH(args...) //info(args)
 
-// Pin's limit is 2Kthreads (as of 2.12)
-#define MAX_THREADS 2048
+using spin::MAX_THREADS;
+
+static_assert(SPIN_MUTEX_NODES == MAX_THREADS + 1, "One MCS node per thread, plus a shared one");
+uint32_t SpinMutexNodeId() {
+    THREADID tid = PIN_ThreadId();
+    return (tid < MAX_THREADS)? tid : MAX_THREADS;
+}
 
 /* State and functions common to fast and slow tracing */
 namespace spin {
     REG tcReg;  // If executor, pointer to threadContext; o/w, null
-    REG tidReg;  // If executor, tid of running thread
+    REG tidReg;  // If executor, tid of running thread (see SetToolRegs for others)
     REG switchReg;  // Used on switches
+    REG undoReg;  // If executor, 1 if the running thread logs memory writes (fast mode)
 
     // Tracing routines need to be predicated on NeedsSwitch (which is
     // guaranteed to inline), and must call RecordSwitch to keep the executor
-    // logic in sync.
+    // logic in sync. RecordSwitch returns the thread to switch to, which
+    // differs from nextTid only if the executor idled (see enableIdling()).
     inline uint64_t NeedsSwitch(uint64_t curTid, uint64_t nextTid) __attribute__((always_inline));
-    void RecordSwitch(THREADID tid, ThreadContext* tc, uint64_t nextTid);
+    uint64_t RecordSwitch(THREADID tid, ThreadContext* tc, uint64_t nextTid, bool atSwitchpoint = true);
+
+    // Inserts a switchcall, or its replacement when recording or replaying a
+    // schedule (see recordSchedule()). Only for IPOINT_BEFORE switchcalls.
+    void InsertSwitchCall(INS ins, const std::function<void()>& insertCall);
 
     // Routines used to infer whether we need to switch
     void NotifySetPC(uint32_t tid);
     void NotifySetLiveReg();  // only used in slow mode
+    // True if the switchcall only changed the running thread's undo logging
+    // mode. Must be called before RecordSwitch.
+    bool IsUndoModeSwitch(uint64_t nextTid);
+    // True if the switchcall kept the same thread, and we're only switching to
+    // drain the capture queue. Must be called before RecordSwitch.
+    bool IsCaptureOnlySwitch(uint64_t nextTid);
+
+    // Speculation state (see checkpoint()), only changed from switchcalls
+    std::array<bool, MAX_THREADS> undoLogging;
+    std::array<UndoLog, MAX_THREADS> undoLogs;
+
+    // Current code cache pressure level (see enableCodePressurePolicy());
+    // tracing code reads it when instrumenting traces
+    CodePressure codePressure = PRESSURE_NONE;
+
+    // Runtime counters (see getStats()), updated by the executor or with
+    // executorMutex held, except codeCacheFlushes, which is updated
+    // atomically. stats.threads is only filled in snapshots.
+    Stats stats = {};
+    std::array<ThreadStats, MAX_THREADS> threadStats;
 };
 
 /* Context state and tracing functions */
@@ -88,6 +139,7 @@ enum ThreadState  {
     //              On switchpoints: IDLE <-> RUNNING
     //              On uncapture points: RUNNING -> UNCAPTURED
     //              On block/unblock: IDLE <-> BLOCKED
+    NUM_STATES
 };
 
 enum SwitchFlags : uint8_t {
@@ -96,11 +148,50 @@ enum SwitchFlags : uint8_t {
     SF_BLOCK = 0x2,
     SF_LOOP = 0x4,
     SF_SETLIVEREG = 0x8,
+    SF_SETMODE = 0x10,  // running thread started or stopped undo logging
 };
 
+// Register checkpoints of speculative threads
+std::array<ContextCheckpoint, MAX_THREADS> checkpoints;
+
 // Executor state (all strictly protected by executorMutex)
-std::array<ThreadState, MAX_THREADS> threadStates;
-std::array<mutex, MAX_THREADS> waitLocks;
+// Written only with SetThreadState(), which also maintains per-state bitmaps
+// (see firstIdle() and friends) and virtual-core run queues
+StateBitmaps<ThreadState, NUM_STATES, MAX_THREADS> threadStates(UNCAPTURED);
+// Physical threads of captured threads wait in parkingSlots until they are
+// handed the executor role or must take a syscall. Tokens are below.
+std::array<ParkingSlot, MAX_THREADS> parkingSlots;
+enum ParkToken {
+    PARK_EXECUTOR = ParkingSlot::FIRST_TOKEN,  // waker made us the executor
+    PARK_SYSCALL,  // take our syscall, we're uncaptured
+    PARK_CAPTURED_SYSCALL,  // take our syscall as the executor
+};
+// Capture queue: threads returning to libspin while the executor is busy
+// push themselves here and park, and the executor captures them at its next
+// switch. It's a lock-free stack of tids (linked through captureNext), whose
+// head is CQ_CLOSED when no executor will drain it soon, CQ_EMPTY, or the
+// last pushed tid + CQ_FIRST_TID.
+#define CQ_CLOSED (0ul)
+#define CQ_EMPTY (1ul)
+#define CQ_FIRST_TID (2ul)
+volatile uint64_t captureQueue = CQ_CLOSED;
+std::array<uint64_t, MAX_THREADS> captureNext;
+
+// Log2 histogram of handoff latencies (TSC cycles)
+std::array<uint64_t, 64> handoffLatencies;
+
+// Executor CPU placement (see setExecutorCpus()). Placements are changed only
+// by each physical thread itself, and the handoff counters only with
+// executorMutex held.
+enum Placement : uint8_t { PLACE_ANY, PLACE_EXECUTOR, PLACE_OTHER };
+bool executorCpusSet;
+cpu_set_t executorCpus;  // where the executor runs
+cpu_set_t otherCpus;  // where threads running shipped syscalls run
+std::array<Placement, MAX_THREADS> placements;
+uint32_t lastExecutorTid = -1u;
+uint32_t lastExecutorCpu = -1u;
+uint64_t executorHandoffs;
+uint64_t executorCoreChanges;
 volatile uint32_t executorTid;  // volatile b/c it's speculatively checked outside of a critical section
 uint32_t curTid;
 uint32_t capturedThreads;
@@ -109,7 +200,173 @@ bool delayedUncaptureAllowed;  // valid only when executor is in syscall
 uint8_t switchFlags;
 // volatile b/c it's speculatively checked outside of a critical section
 volatile bool inUncaptureCallback;
-aligned_mutex executorMutex;
+
+// The lock implementation is chosen at build time (see spin_mutex.h)
+aligned_spin_mutex executorMutex;
+lock_stats_t executorLockStats;
+bool executorLockTracked = false;  // see enableLockStats()
+
+// Multi-process executor domain (see joinDomain()). The token is held by this
+// process whenever one of its threads is the executor and runs guest code, and
+// is released while the executor is in a syscall and no other thread runs.
+#define MAX_DOMAIN_PROCS 64
+struct DomainState {
+    volatile uint32_t token;  // 0 if free, procIdx+1 of the holder otherwise
+    volatile uint64_t members;  // bit per joined process
+    volatile uint64_t waiters;  // bit per process waiting for the token
+} ATTR_LINE_ALIGNED;
+DomainState* domain = nullptr;  // null if not in a domain
+uint32_t domainTokenId;
+std::string domainName;
+
+void AcquireDomainToken() {
+    if (!domain || domain->token == domainTokenId) return;
+    // Advertise that we wait, so domainHandoff() can pass the token to us
+    uint64_t bit = 1ul << (domainTokenId - 1);
+    __sync_fetch_and_or(&domain->waiters, bit);
+    futex_token_acquire(&domain->token, domainTokenId);
+    __sync_fetch_and_and(&domain->waiters, ~bit);
+}
+
+void ReleaseDomainToken() {
+    if (domain) futex_token_pass(&domain->token, 0);
+}
+
+// Fork-server state (see forkServer()). In a forked child, only the
+// executor's physical thread survives, so it runs every syscall itself.
+bool inForkChild = false;
+uint32_t liveThreads;  // started and not finished
+std::array<uint64_t, MAX_THREADS> clearTidAddrs;  // CLONE_CHILD_CLEARTID / set_tid_address, 0 if none
+
+// A new thread can't tell clone from clone3 (whose args are in memory the
+// parent may reuse by then), so the parent decodes the args when it enters
+// the syscall, and the child's kernel tid links them to the child's
+// ThreadStart, which may run before or after the parent returns. Accessed
+// with executorMutex held.
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+std::array<bool, MAX_THREADS> clonePending;  // per parent, in a thread-creating clone
+std::array<uint64_t, MAX_THREADS> cloneClearTids;  // per parent, the child's clear-tid addr
+std::map<uint32_t, uint64_t> clearTidsByOsTid;  // children not started yet
+std::map<uint32_t, uint32_t> startedByOsTid;  // children whose parent has not returned yet
+
+// Reference counts of non-zero clearTidAddrs, for quick lookups by address
+std::unordered_map<uint64_t, uint32_t> clearTidRefs;
+
+void SetClearTidAddr(uint32_t tid, uint64_t addr) {
+    uint64_t old = clearTidAddrs[tid];
+    if (old) {
+        auto it = clearTidRefs.find(old);
+        if (--it->second == 0) clearTidRefs.erase(it);
+    }
+    clearTidAddrs[tid] = addr;
+    if (addr) clearTidRefs[addr]++;
+}
+
+bool IsClearTidAddr(uint64_t addr) {
+    return clearTidRefs.count(addr);
+}
+
+// Called when tid enters a clone or clone3 syscall
+void RecordCloneArgs(uint32_t tid, const ThreadContext* tc, uint64_t nr) {
+    uint64_t flags, childTid;
+    if (nr == SYS_clone3) {
+        // struct clone_args begins with the flags, pidfd, and child_tid u64s
+        uint64_t args[3];
+        if (PIN_SafeCopy(args, (const void*)getReg(tc, REG_RDI), sizeof(args)) != sizeof(args)) return;  // clone3 fails
+        flags = args[0];
+        childTid = args[2];
+    } else {
+        flags = getReg(tc, REG_RDI);
+        childTid = getReg(tc, REG_R10);
+    }
+    // Only threads get a ThreadStart; forked processes keep their tids
+    clonePending[tid] = flags & CLONE_THREAD;
+    cloneClearTids[tid] = (flags & CLONE_CHILD_CLEARTID)? childTid : 0;
+}
+
+// Called when tid returns from a thread-creating clone, whose result is in ctxt
+void FinishClone(uint32_t tid, const CONTEXT* ctxt) {
+    executorMutex.lock();
+    clonePending[tid] = false;
+    int64_t childOsTid = PIN_GetContextReg(ctxt, REG_RAX);
+    if (childOsTid > 0) {
+        auto it = startedByOsTid.find(childOsTid);
+        if (it != startedByOsTid.end()) {
+            SetClearTidAddr(it->second, cloneClearTids[tid]);
+            startedByOsTid.erase(it);
+        } else {
+            clearTidsByOsTid[childOsTid] = cloneClearTids[tid];
+        }
+    }
+    executorMutex.unlock();
+}
+
+// Schedule record and replay (see recordSchedule()). Event positions count the
+// switchpoints run by the executor, which is the only thread that advances
+// schedSwitchpoints; events themselves are logged and consumed with
+// executorMutex held.
+enum ScheduleMode { SCHED_NONE, SCHED_RECORD, SCHED_REPLAY };
+ScheduleMode scheduleMode = SCHED_NONE;
+uint64_t schedSwitchpoints = 0;
+uint64_t schedLastEvent = 0;  // schedSwitchpoints at the last event
+ScheduleWriter* schedWriter = nullptr;  // record only
+std::vector<ScheduleEvent> schedEvents;  // replay only
+size_t schedCursor = 0;  // next event to replay
+volatile uint32_t schedSeq = 0;  // futex, bumped on replay progress
+
+void CountSwitchpoint() {
+    schedSwitchpoints++;
+}
+
+void LogScheduleEvent(ScheduleEventType type, uint32_t tid) {
+    if (scheduleMode != SCHED_RECORD) return;
+    schedWriter->write({schedSwitchpoints - schedLastEvent, tid, type});
+    schedLastEvent = schedSwitchpoints;
+}
+
+void ScheduleFini(INT32 code, VOID* v) {
+    schedWriter->flush();
+}
+
+bool ScheduleEventDue() {
+    return schedCursor < schedEvents.size() &&
+        schedSwitchpoints == schedLastEvent + schedEvents[schedCursor].delta;
+}
+
+bool ScheduleEventDue(ScheduleEventType type) {
+    return ScheduleEventDue() && schedEvents[schedCursor].type == type;
+}
+
+// Wake up all threads waiting on the replay to progress
+void KickSchedule() {
+    schedSeq++;
+    syscall(SYS_futex, &schedSeq, FUTEX_WAKE, 0x7fffffff /*wake all*/, NULL, NULL, 0);
+}
+
+void AdvanceSchedule() {
+    schedLastEvent = schedSwitchpoints;
+    schedCursor++;
+    KickSchedule();
+}
+
+// Must be called with executorMutex held, which is released while waiting
+void WaitForSchedule() {
+    uint32_t seq = schedSeq;
+    executorMutex.unlock();
+    syscall(SYS_futex, &schedSeq, FUTEX_WAIT, seq, NULL, NULL, 0);
+    executorMutex.lock();
+}
+
+void ScheduleDiverged(const char* where, uint32_t tid) {
+    if (schedCursor == schedEvents.size()) {
+        panic("Schedule replay ran past the recorded schedule at %s of thread %d", where, tid);
+    }
+    const ScheduleEvent& ev = schedEvents[schedCursor];
+    panic("Schedule replay diverged at %s of thread %d: expected event %ld (type %d, tid %d) %ld switchpoints after the last one, at %ld",
+            where, tid, schedCursor, ev.type, ev.tid, ev.delta, schedSwitchpoints - schedLastEvent);
+}
 
 // Callbacks, set on init or separately
 TraceCallback traceCallback = nullptr;
@@ -120,6 +377,100 @@ ThreadCallback threadEndCallback = nullptr;
 SyscallEnterCallback syscallEnterCallback = nullptr;
 SyscallExitCallback syscallExitCallback = nullptr;
 
+// Syscall emulators, indexed by syscall number (see setSyscallEmulator())
+#define MAX_SYSCALLS 512
+std::array<SyscallEmulator, MAX_SYSCALLS> syscallEmulators;
+
+// Adaptive syscall policy: syscalls that are reliably short keep the
+// executor role instead of shipping it to another physical thread. Other
+// threads do not run the delayed uncapture of a kept syscall; if it blocks,
+// the watchdog (spawned on the first keep) runs it, and the syscall is
+// shipped from then on, as its profile shows a recent long run.
+#define MIN_SYSCALL_SAMPLES 16  // runs without a long one before keeping
+#define SHORT_SYSCALL_NS 5000  // avg below this keeps the executor
+#define LONG_SYSCALL_NS 1000000  // runs over this are treated as blocking
+#define SYSCALL_WATCHDOG_US 500
+struct SyscallProfile {
+    SyscallStats stats;
+    uint64_t samplesSinceLong;
+};
+std::array<SyscallProfile, MAX_SYSCALLS> syscallProfiles;
+std::array<SyscallPolicy, MAX_SYSCALLS> syscallPolicies;  // SYSCALL_AUTO by default
+std::array<uint64_t, MAX_THREADS> syscallStartNs;  // 0 if not measuring
+std::array<uint64_t, MAX_THREADS> syscallNrs;
+// Emulated syscalls continued in place (see ContinueThroughSyscall())
+std::array<bool, MAX_THREADS> emulatedSyscall;
+std::array<uint64_t, MAX_THREADS> emulatedResults;
+bool executorKeptSyscall = false;  // executorInSyscall for a kept syscall
+bool watchdogSpawned = false;
+PIN_THREAD_UID watchdogUid;
+volatile bool watchdogExit = false;
+
+// Idling with no runnable threads (see enableIdling()). While idle, the
+// executor keeps its role with curTid == -1u, and waits in RecordSwitch.
+bool idlingEnabled = false;
+IdleCallback idleCallback = nullptr;
+bool executorIdle = false;
+uint32_t idleNextTid = -1u;  // first thread made runnable while idle
+volatile uint32_t idleEvents;  // futex word, bumped when threads become runnable
+
+// Timed blocking (see blockUntil()), with executorMutex held
+TimerWheel timerWheel(MAX_THREADS);
+
+// Virtual-core run queues of idle threads (see enableVirtualCores()), with
+// executorMutex held
+RunQueues runQueues(MAX_THREADS);
+StealPolicy stealPolicy = STEAL_NONE;
+uint32_t minStealLength = 1;
+uint64_t steals = 0;
+
+void SetThreadState(ThreadId tid, ThreadState state) {
+    threadStates.set(tid, state);
+    if (runQueues.size()) {
+        if (state == IDLE) runQueues.push(tid);
+        else runQueues.remove(tid);
+    }
+}
+
+// Virtual time (see enableVirtualTime())
+TimeCallback timeCallback = nullptr;
+UncaptureCallback sleepCallback = nullptr;
+CaptureCallback sleepWakeCallback = nullptr;
+uint64_t tscMHz;
+uint64_t realtimeBaseNs;  // host CLOCK_REALTIME when enabled
+std::array<bool, MAX_THREADS> sleeping;  // blocked in an emulated sleep
+std::map<ADDRINT, uint64_t> vdsoEntries;  // vDSO function -> syscall it implements
+
+// Spin-wait detection (see setSpinCallback())
+SpinCallback spinCallback = nullptr;
+bool detectSpinLoops = false;
+// Longest load-compare-branch loop treated as a spin-wait
+#define MAX_SPIN_LOOP_INSTRS 8
+
+// Futex emulation (see enableFutexEmulation()). Waits that libspin can't
+// emulate go to the kernel, so wakes are forwarded while any are pending.
+bool futexEmulation = false;
+UncaptureCallback futexWaitCallback = nullptr;
+CaptureCallback futexWakeCallback = nullptr;
+FutexTable futexTable;
+std::array<bool, MAX_THREADS> inKernelFutexWait;
+uint32_t kernelFutexWaits = 0;
+
+// I/O offload (see enableIoOffload()). Each thread keeps its request, so
+// requests canceled by the exit of the physical thread that submitted them
+// can be resubmitted. Threads with a request in flight are blocked until
+// CompleteIo(), and Unblock() leaves them alone.
+#define IO_RING_ENTRIES 256
+bool ioOffload = false;
+UncaptureCallback ioBlockCallback = nullptr;
+CaptureCallback ioCompleteCallback = nullptr;
+IoRing ioRing;
+std::array<io_uring_sqe, MAX_THREADS> ioRequests;
+std::array<bool, MAX_THREADS> ioPending;
+uint32_t ioInFlight = 0;
+PIN_THREAD_UID ioThreadUid;
+volatile bool ioThreadExit = false;
+
 /* Helper debug method */
 void PrintContext(uint32_t tid, const char* desc, const CONTEXT* ctxt) {
     auto r = [&](REG reg) -> void* {
@@ -144,7 +495,24 @@ void ThreadStart(THREADID tid, CONTEXT* ctxt, INT32 flags, VOID* v) {
     DEBUG("Thread %d started", tid);
     threadStartCallback(tid);
     assert(threadStates[tid] == UNCAPTURED);
-    PIN_SetContextReg(ctxt, tcReg, (ADDRINT)nullptr);  // will be captured immediately
+    SetToolRegs(ctxt, tid, true);  // will be captured immediately
+    ClearSyscallPc(tid);  // but it did not leave with its tc's registers
+    liveThreads++;
+
+    // Record where its exit should clear the tid (needed in fork-server
+    // children, where exits are run by the executor; see RunSyscallInline)
+    // once its parent returns from clone, unless it already has
+    SetClearTidAddr(tid, 0);
+    if (tid) {
+        uint32_t osTid = PIN_GetTid();
+        auto it = clearTidsByOsTid.find(osTid);
+        if (it != clearTidsByOsTid.end()) {
+            SetClearTidAddr(tid, it->second);
+            clearTidsByOsTid.erase(it);
+        } else {
+            startedByOsTid[osTid] = tid;
+        }
+    }
     executorMutex.unlock();
 }
 
@@ -157,37 +525,301 @@ void ThreadFini(THREADID tid, const CONTEXT* ctxt, INT32 code, VOID* v) {
         // uncaptureCallback, but the tool can detect termination by seeing the
         // thread count go to 0.
         // FIXME: Race between thread creation and exit?
+        ReleaseDomainToken();
     } else {
         assert(threadStates[tid] == UNCAPTURED);
     }
+    liveThreads--;
+    SetClearTidAddr(tid, 0);
+    undoLogging[tid] = false;
+    undoLogs[tid].clear();
     threadEndCallback(tid);
     executorMutex.unlock();
 }
 
+/* Syscall profiling, for the adaptive syscall policy */
+
+uint64_t MonotonicNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+// Whether the running thread's syscall nr should keep the executor role
+bool KeepsExecutor(uint64_t nr) {
+    if (nr >= MAX_SYSCALLS || scheduleMode != SCHED_NONE) return false;
+    switch (syscallPolicies[nr]) {
+        case SYSCALL_SHIP: return false;
+        case SYSCALL_KEEP: return true;
+        default: {
+            const SyscallProfile& p = syscallProfiles[nr];
+            return p.samplesSinceLong >= MIN_SYSCALL_SAMPLES && p.stats.avgNs < SHORT_SYSCALL_NS;
+        }
+    }
+}
+
+// Called just before the physical thread runs tid's syscall
+void StartSyscallTimer(uint32_t tid) {
+    if (syscallNrs[tid] < MAX_SYSCALLS) syscallStartNs[tid] = MonotonicNs();
+}
+
+// Called with executorMutex held when tid returns from its syscall
+void EndSyscallTimer(uint32_t tid) {
+    if (!syscallStartNs[tid]) return;
+    uint64_t ns = MonotonicNs() - syscallStartNs[tid];
+    syscallStartNs[tid] = 0;
+
+    SyscallProfile& p = syscallProfiles[syscallNrs[tid]];
+    SyscallStats& st = p.stats;
+    st.avgNs = st.count? (7 * st.avgNs + ns) / 8 : ns;  // EWMA
+    st.count++;
+    st.totalNs += ns;
+    st.maxNs = std::max(st.maxNs, ns);
+    if (ns > LONG_SYSCALL_NS) {
+        st.longCount++;
+        p.samplesSinceLong = 0;
+    } else {
+        p.samplesSinceLong++;
+    }
+}
+
+/* Blocking and unblocking, with executorMutex held */
+
+// Called when tid becomes runnable, to wake an idle executor
+void NotifyIdleExecutor(ThreadId tid) {
+    if (!executorIdle) return;
+    if (idleNextTid == -1u) idleNextTid = tid;
+    __sync_fetch_and_add(&idleEvents, 1);
+    syscall(SYS_futex, &idleEvents, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+void BlockIdle(ThreadId tid) {
+    assert(tid < MAX_THREADS);
+    assert(threadStates[tid] == IDLE);
+    assert(capturedThreads > 1);
+    SetThreadState(tid, BLOCKED);
+    capturedThreads--;
+    LogScheduleEvent(EV_BLOCK, tid);
+}
+
+// Returns whether the thread was unblocked
+bool Unblock(ThreadId tid) {
+    assert(tid < MAX_THREADS);
+    if (ioPending[tid]) return false;  // only its completion unblocks it
+    timerWheel.cancel(tid);
+    sleeping[tid] = false;
+    futexTable.remove(tid);  // a futex waiter returns as if woken
+    if (threadStates[tid] == BLOCKED) {
+        SetThreadState(tid, IDLE);
+        capturedThreads++;
+        LogScheduleEvent(EV_UNBLOCK, tid);
+        NotifyIdleExecutor(tid);
+    } else {
+        // An unblock fired right after a call to blockAfterSwitch. This makes
+        // blockAfterSwitch look functionally equivalent to being blocked
+        // TODO: Simplify interface: block() and unblock() for arbitrary threads!
+        assert(switchFlags & SF_BLOCK);
+        assert(threadStates[tid] == RUNNING);
+        switchFlags &= ~SF_BLOCK;
+    }
+    return true;
+}
+
+/* Schedule replay. Instead of calling switchcalls and uncaptureCallback,
+ * follow the recorded events, and hold each capture until its turn.
+ */
+
+// Applies the block and unblock events due at the current position (which the
+// tool's callbacks may have caused anywhere), and lets due captures happen
+// before the executor moves on. Called with executorMutex held; may release it.
+void ApplyDueScheduleEvents() {
+    while (ScheduleEventDue()) {
+        const ScheduleEvent& ev = schedEvents[schedCursor];
+        if (ev.type == EV_CAPTURE) {
+            KickSchedule();  // the capturing thread may be waiting for its turn
+            WaitForSchedule();
+            continue;
+        } else if (ev.type == EV_BLOCK) {
+            BlockIdle(ev.tid);
+        } else if (ev.type == EV_UNBLOCK) {
+            Unblock(ev.tid);
+        } else {
+            break;
+        }
+        AdvanceSchedule();
+    }
+}
+
+// Replaces switchcalls. Returns the next tid, like a switchcall.
+uint64_t ReplaySwitchcall(uint64_t runningTid) {
+    // Most switchpoints are far from the next event, and then need no lock:
+    // only the executor (us) advances schedSwitchpoints, and other threads
+    // only advance the schedule at events that are due, which waits for us
+    if (schedCursor < schedEvents.size() &&
+            schedSwitchpoints + 1 < schedLastEvent + schedEvents[schedCursor].delta) {
+        schedSwitchpoints++;
+        return runningTid;
+    }
+
+    executorMutex.lock();
+    stats.replayLockedSwitchpoints++;
+    ApplyDueScheduleEvents();
+    schedSwitchpoints++;
+    ApplyDueScheduleEvents();
+    uint64_t nextTid = runningTid;
+    // Other events (uncaptures, syscall returns, futex waits) are replayed at syscalls
+    if (ScheduleEventDue(EV_SWITCH) || ScheduleEventDue(EV_SWITCH_BLOCK)) {
+        const ScheduleEvent& ev = schedEvents[schedCursor];
+        nextTid = ev.tid;
+        if (ev.type == EV_SWITCH_BLOCK) switchFlags |= SF_BLOCK;
+        // A recorded switch to the same thread ran the switchcall again
+        else if (nextTid == runningTid) switchFlags |= SF_LOOP;
+        AdvanceSchedule();
+    }
+    executorMutex.unlock();
+    return nextTid;
+}
+
+// Called with executorMutex held by the uncaptured thread; may release it.
+// Blocks and unblocks recorded at this position come before the uncapture (a
+// blocked thread must not be picked), not just captures.
+uint64_t ReplayUncapture() {
+    ApplyDueScheduleEvents();
+    if (!ScheduleEventDue(EV_UNCAPTURE)) ScheduleDiverged("uncapture", curTid);
+    uint64_t nextTid = schedEvents[schedCursor].tid;
+    AdvanceSchedule();
+    return nextTid;
+}
+
+// Called with executorMutex held by a thread returning from a syscall, whether
+// or not it's still the executor; may release it
+void ReplayCapture(THREADID tid) {
+    if (threadStates[tid] == RUNNING) {
+        // Captures recorded before our return go first, and may uncapture us
+        ApplyDueScheduleEvents();
+        if (threadStates[tid] == RUNNING) {
+            if (!ScheduleEventDue(EV_EXEC_RETURN)) ScheduleDiverged("syscall return", tid);
+            AdvanceSchedule();
+            return;
+        }
+    }
+    while (!(ScheduleEventDue(EV_CAPTURE) && schedEvents[schedCursor].tid == tid)) {
+        WaitForSchedule();
+    }
+    AdvanceSchedule();
+}
+
+void InsertSwitchCall(INS ins, const std::function<void()>& insertCall) {
+    if (scheduleMode == SCHED_REPLAY) {
+        INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)ReplaySwitchcall,
+                IARG_REG_VALUE, tidReg, IARG_RETURN_REGS, switchReg, IARG_END);
+    } else {
+        if (scheduleMode == SCHED_RECORD) {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)CountSwitchpoint, IARG_END);
+        }
+        insertCall();
+    }
+}
+
 /* Tracing sequence*/
 
 // Helper method for guards. Must be called with executorMutex held
 void UncaptureAndSwitch() {
-    // The callback may run code that calls spin::unblock and spin::block. For
-    // example, in ordspecsim, in an effort to find a next thread, the simulator
-    // could process several non-thread events, some of which affect thread
-    // state, e.g. AbortTaskOnThread. If the uncaptureCallback calls
-    // spin::unblock, it's safe to skip the lock, since we know it's held.
-    inUncaptureCallback = true;
-    uint64_t nextTid = uncaptureCallback(curTid, GetTC(curTid));
-    inUncaptureCallback = false;
+    uint64_t nextTid;
+    if (scheduleMode == SCHED_REPLAY) {
+        nextTid = ReplayUncapture();
+    } else {
+        // The callback may run code that calls spin::unblock and spin::block.
+        // For example, in ordspecsim, in an effort to find a next thread, the
+        // simulator could process several non-thread events, some of which
+        // affect thread state, e.g. AbortTaskOnThread. If the
+        // uncaptureCallback calls spin::unblock, it's safe to skip the lock,
+        // since we know it's held.
+        inUncaptureCallback = true;
+        nextTid = uncaptureCallback(curTid, GetTC(curTid));
+        inUncaptureCallback = false;
+    }
     if (nextTid >= MAX_THREADS) panic("Switchcall returned invalid tid %d", nextTid);
     if (threadStates[nextTid] != IDLE) {
         panic("Switchcall returned tid %d, which is not IDLE (state[%d] = %d, curTid = %d executorTid = %d)",
                 nextTid, nextTid, threadStates[nextTid], curTid, executorTid);
     }
+    LogScheduleEvent(EV_UNCAPTURE, nextTid);
+    stats.uncaptures++;
+    threadStats[curTid].uncaptures++;
 
     capturedThreads--;
     assert(threadStates[curTid] == RUNNING);
-    threadStates[curTid] = UNCAPTURED;
+    SetThreadState(curTid, UNCAPTURED);
     curTid = nextTid;
     assert(threadStates[curTid] == IDLE);
-    threadStates[curTid] = RUNNING;
+    SetThreadState(curTid, RUNNING);
+}
+
+/* Capture queue */
+
+bool CaptureQueueAllowed() {
+    return scheduleMode == SCHED_NONE && !inForkChild;  // captures are logged and replayed in order
+}
+
+// Captures tid after it returns from a syscall or starts, with executorMutex
+// held. Does what TraceGuard does for captures, except waking anyone.
+void CaptureQueued(uint32_t tid) {
+    ThreadContext* tc = GetTC(tid);
+    EndSyscallTimer(tid);
+    if (inKernelFutexWait[tid]) {
+        inKernelFutexWait[tid] = false;
+        kernelFutexWaits--;
+    }
+    if (syscallExitCallback) syscallExitCallback(tid, tc);
+
+    assert(threadStates[tid] == UNCAPTURED);
+    // The executor's thread is captured, so !runsNext; an idle executor
+    // instead picks the first queued thread
+    assert(capturedThreads || executorIdle);
+    capturedThreads++;
+    SetThreadState(tid, IDLE);
+    LogScheduleEvent(EV_CAPTURE, tid);
+    stats.captures++;
+    threadStats[tid].captures++;
+    DEBUG("Captured queued thread %d", tid);
+    captureCallback(tid, false);
+    NotifyIdleExecutor(tid);
+}
+
+// Captures all queued threads in arrival order, then leaves the queue empty,
+// or closed if close is set. Called with executorMutex held.
+void DrainCaptureQueue(bool close) {
+    uint64_t head = __sync_lock_test_and_set(&captureQueue, close? CQ_CLOSED : CQ_EMPTY);
+    if (head < CQ_FIRST_TID) return;
+
+    // Reverse the stack
+    uint64_t fifo = CQ_EMPTY;
+    while (head >= CQ_FIRST_TID) {
+        uint64_t next = captureNext[head - CQ_FIRST_TID];
+        captureNext[head - CQ_FIRST_TID] = fifo;
+        fifo = head;
+        head = next;
+    }
+    for (; fifo >= CQ_FIRST_TID; fifo = captureNext[fifo - CQ_FIRST_TID]) {
+        CaptureQueued(fifo - CQ_FIRST_TID);
+    }
+}
+
+// Called with executorMutex held once an executor runs guest code (i.e., it
+// is not in a syscall), so it will reach a switch to drain the queue
+void OpenCaptureQueue() {
+    if (CaptureQueueAllowed()) __sync_bool_compare_and_swap(&captureQueue, CQ_CLOSED, CQ_EMPTY);
+}
+
+// Lock-free; returns false if the queue is closed
+bool PushCapture(uint32_t tid) {
+    while (true) {
+        uint64_t head = captureQueue;
+        if (head == CQ_CLOSED) return false;
+        captureNext[tid] = head;
+        if (__sync_bool_compare_and_swap(&captureQueue, head, tid + CQ_FIRST_TID)) return true;
+    }
 }
 
 // Execute specified tid, does not return
@@ -195,20 +827,145 @@ void Execute(ThreadId tid, bool isSyscall) {
     ThreadContext* tc = GetTC(tid);
     UpdatePinContext(tc);
     CONTEXT* pinCtxt = GetPinCtxt(tc);
-    PIN_SetContextReg(pinCtxt, tcReg, (ADDRINT)(isSyscall? nullptr : tc));
-    PIN_SetContextReg(pinCtxt, tidReg, isSyscall? -1 : tid);
+    SetToolRegs(pinCtxt, tid, isSyscall);
     PIN_ExecuteAt(pinCtxt);
 }
 
+// Moves the calling thread (pid 0) to cpus
+void SetAffinity(const cpu_set_t* cpus) {
+    if (sched_setaffinity(0, sizeof(cpu_set_t), cpus) != 0) {
+        panic("sched_setaffinity() failed: %s", strerror(errno));
+    }
+}
+
+// Called by the physical thread tid once it holds the executor role, without
+// executorMutex held. If executor CPUs are set, moves it to them (once, it
+// stays there while it holds the role) and counts whether the role changed
+// cores. The counters are updated under executorMutex, as the thread that
+// held the role before may still be placing itself (e.g., a thread woken to
+// take its captured syscall while a delayed uncapture hands the role over).
+void PlaceExecutor(uint32_t tid) {
+    if (!executorCpusSet) return;
+    if (placements[tid] != PLACE_EXECUTOR) {
+        SetAffinity(&executorCpus);
+        placements[tid] = PLACE_EXECUTOR;
+    }
+    uint32_t cpu = sched_getcpu();
+    executorMutex.lock();
+    if (tid != lastExecutorTid) {
+        lastExecutorTid = tid;
+        executorHandoffs++;
+        if (lastExecutorCpu != -1u && cpu != lastExecutorCpu) executorCoreChanges++;
+        lastExecutorCpu = cpu;
+    }
+    executorMutex.unlock();
+}
+
+// Called by the physical thread tid before it runs a shipped syscall, so it
+// does not compete with the executor
+void PlaceNonExecutor(uint32_t tid) {
+    if (executorCpusSet && placements[tid] != PLACE_OTHER) {
+        SetAffinity(&otherCpus);
+        placements[tid] = PLACE_OTHER;
+    }
+}
+
+// Makes tid, which must be waiting in WaitForExecutorRoleOrSyscall, the
+// executor. The new executor does not need executorMutex to take over, and no
+// other thread can claim the role meanwhile. Called with executorMutex held.
+void HandOffExecutor(uint32_t tid) {
+    executorTid = tid;
+    assert(!executorInSyscall);
+    OpenCaptureQueue();
+    parkingSlots[tid].unpark(PARK_EXECUTOR);
+}
+
+// The executor's thread is in a syscall and other threads can run: uncapture
+// it, as TraceGuard would, and wake the next thread to become the executor.
+// Called with executorMutex held from libspin's internal threads.
+void RunDelayedUncapture() {
+    assert(executorInSyscall && delayedUncaptureAllowed && capturedThreads >= 2);
+    stats.delayedUncaptures++;
+    UncaptureAndSwitch();
+    executorInSyscall = false;
+    executorKeptSyscall = false;
+    HandOffExecutor(curTid);
+}
+
+// Bounds how long a kept syscall that turned out to block stalls the others
+void SyscallWatchdogThread(VOID* arg) {
+    while (!watchdogExit) {
+        usleep(SYSCALL_WATCHDOG_US);
+        executorMutex.lock();
+        if (executorInSyscall && executorKeptSyscall && capturedThreads >= 2 &&
+                syscallStartNs[curTid] && MonotonicNs() - syscallStartNs[curTid] > LONG_SYSCALL_NS) {
+            DEBUG("WD: Syscall %ld of executor thread %d is blocking, running delayed uncapture",
+                    syscallNrs[curTid], curTid);
+            delayedUncaptureAllowed = true;
+            RunDelayedUncapture();
+        }
+        executorMutex.unlock();
+    }
+}
+
+// Called with executorMutex held when a syscall first keeps the executor
+void SpawnWatchdog() {
+    if (watchdogSpawned) return;
+    if (PIN_SpawnInternalThread(SyscallWatchdogThread, nullptr, 0, &watchdogUid) == INVALID_THREADID) {
+        panic("Could not spawn syscall watchdog thread");
+    }
+    watchdogSpawned = true;
+}
+
+void WatchdogFini(VOID* arg) {
+    if (!watchdogSpawned) return;
+    watchdogExit = true;
+    PIN_WaitForThreadTermination(watchdogUid, PIN_INFINITE_TIMEOUT, nullptr);
+}
+
+// Guards end by running curTid. If that's the thread that tripped the guard,
+// and where it must run next (its tc's PC, which callbacks, rollbacks, and
+// setReg() calls since the guard may have changed) is still resumePc, where
+// the guard's trace continues, just continue through the trace (the guard
+// returns its tc to tcReg), which avoids a full ExecuteAt. Another thread
+// needs its own PC, which only ExecuteAt can jump to from a guard. Called
+// without executorMutex held.
+ADDRINT ResumeAfterGuard(THREADID tid, const CONTEXT* ctxt, ADDRINT resumePc) {
+    if (curTid == tid && CanResumeInPlace(tid, ctxt, resumePc)) {
+        ResumeInPlace(tid);
+        return (ADDRINT)GetTC(tid);
+    }
+    Execute(curTid, false);
+    return 0;  // unreachable
+}
+
 uint64_t RunTraceGuard(uint64_t executor) {
     return !executor;
 }
 
 // Helper, see below (also used from RecordSwitch)
 void WaitForExecutorRoleOrSyscall(THREADID tid, bool alwaysBlock);
+void ParkUntilExecutor(THREADID tid);
+
+// Runs only if we're coming back from a syscall. Returns the tc to continue
+// with, or does not return.
+ADDRINT TraceGuard(THREADID tid, const CONTEXT* ctxt) {
+    if (unlikely(clonePending[tid])) FinishClone(tid, ctxt);
+    ADDRINT resumePc = PIN_GetContextReg(ctxt, REG_RIP);  // before anything can change tc
+
+    // Fast path: if an executor is running guest code, queue ourselves to be
+    // captured at its next switch, and wait without taking executorMutex.
+    // Only an uncaptured thread can be in the queue, and only we can change
+    // our state from UNCAPTURED.
+    if (threadStates[tid] == UNCAPTURED && captureQueue != CQ_CLOSED) {
+        InitContext(ctxt, GetTC(tid));
+        if (PushCapture(tid)) {
+            DEBUG("[%d] TG: Queued for capture", tid);
+            ParkUntilExecutor(tid);
+            return ResumeAfterGuard(tid, ctxt, resumePc);
+        }
+    }
 
-// Runs only if we're coming back from a syscall
-void TraceGuard(THREADID tid, const CONTEXT* ctxt) {
     executorMutex.lock();
     assert(PIN_GetContextReg(ctxt, tcReg) == (ADDRINT)nullptr);
     DEBUG("[%d] In TraceGuard() (curTid %d rip 0x%lx er %d state %d ncap %d)", tid, curTid,
@@ -217,6 +974,18 @@ void TraceGuard(THREADID tid, const CONTEXT* ctxt) {
 
     ThreadContext* tc = GetTC(tid);
     InitContext(ctxt, tc);
+    if (unlikely(emulatedSyscall[tid])) {
+        // Back from the stand-in getpid (see ContinueThroughSyscall)
+        assert(threadStates[tid] == RUNNING);
+        setReg(tc, REG_RAX, emulatedResults[tid]);
+        emulatedSyscall[tid] = false;
+    }
+
+    EndSyscallTimer(tid);
+    if (inKernelFutexWait[tid]) {
+        inKernelFutexWait[tid] = false;
+        kernelFutexWaits--;
+    }
 
     // syscallExitCallback may change tc, but unlike with syscallEnter, we
     // don't need to do anything special to handle changes to the PC.
@@ -229,6 +998,8 @@ void TraceGuard(THREADID tid, const CONTEXT* ctxt) {
     // out the first entry into userspace.
     if (syscallExitCallback) syscallExitCallback(tid, tc);
 
+    if (scheduleMode == SCHED_REPLAY) ReplayCapture(tid);  // may release executorMutex
+
     if (threadStates[tid] == RUNNING) {
         // We did not yield executor role when we ran the syscall, so keep
         // going as usual
@@ -236,16 +1007,23 @@ void TraceGuard(THREADID tid, const CONTEXT* ctxt) {
         assert(curTid == tid);
         assert(capturedThreads == 1 || !delayedUncaptureAllowed);
         executorInSyscall = false;
+        executorKeptSyscall = false;
+        OpenCaptureQueue();
+        LogScheduleEvent(EV_EXEC_RETURN, tid);
         DEBUG("[%d] TG: Single thread, becoming executor", tid);
         executorMutex.unlock();
-        Execute(tid, false);
+        AcquireDomainToken();
+        return ResumeAfterGuard(tid, ctxt, resumePc);
     }
 
     assert(threadStates[tid] == UNCAPTURED);
     bool runsNext = (capturedThreads == 0);
 
     capturedThreads++;
-    threadStates[tid] = IDLE;
+    SetThreadState(tid, IDLE);
+    LogScheduleEvent(EV_CAPTURE, tid);
+    stats.captures++;
+    threadStats[tid].captures++;
 
     captureCallback(tid, runsNext);
     // captureCallback yields our context to others. After this point, tc might have changed.
@@ -253,9 +1031,10 @@ void TraceGuard(THREADID tid, const CONTEXT* ctxt) {
     if (runsNext) {
         DEBUG("[%d] TG: Only captured thread", tid);
         // We're the first! Make us run
-        threadStates[tid] = RUNNING;
+        SetThreadState(tid, RUNNING);
         assert(curTid == -1u);
         curTid = tid;
+        NotifyIdleExecutor(tid);
     }
 
     if (executorInSyscall && delayedUncaptureAllowed) {
@@ -263,114 +1042,842 @@ void TraceGuard(THREADID tid, const CONTEXT* ctxt) {
         assert(curTid == executorTid);
         assert(capturedThreads == 2);  // the non-uncaptured executor and us
         // Do delayed uncapture
+        stats.delayedUncaptures++;
         UncaptureAndSwitch();
         executorTid = -1u;
         executorInSyscall = false;
     }
 
     WaitForExecutorRoleOrSyscall(tid, false /*don't block if no executor*/);
+    return ResumeAfterGuard(tid, ctxt, resumePc);
+}
+
+// Parks until we're handed the executor role, and returns; never returns if
+// we are woken up to take a syscall. Called without executorMutex held.
+void ParkUntilExecutor(THREADID tid) {
+    uint64_t latency;
+    uint32_t token = parkingSlots[tid].park(&latency);
+    __sync_fetch_and_add(&handoffLatencies[63 - __builtin_clzl(latency | 1)], 1);
+
+    if (token == PARK_EXECUTOR) {
+        // Direct handoff: the waker already made us the executor, and
+        // set up curTid for us
+        assert(executorTid == tid);
+        DEBUG("[%d] WES: Handed executor role (curTid = %d)", tid, curTid);
+        PlaceExecutor(tid);
+        AcquireDomainToken();  // no-op if the executor role moved within this process
+        return;
+    }
+
+    // A thread may take a syscall either when it's uncaptured or while
+    // still captured **and the executor**. If it's captured and
+    // delayedUncaputreAllowed is set, then another thread returning from a
+    // syscall can perform a delayed uncapture: uncapturing the executor
+    // and claiming the executor role itself. See SyscallGuard for the
+    // delayed uncapture code.
+    DEBUG("[%d] WES: Wakeup, taking own syscall (%s)", tid,
+            (token == PARK_CAPTURED_SYSCALL)? "(captured)" : "(uncaptured)");
+    if (token == PARK_CAPTURED_SYSCALL) {
+        // A captured syscall stops this process's executor, so let other
+        // processes in the domain run meanwhile. Release with the lock
+        // held, as a delayed uncapture may claim the token right after.
+        executorMutex.lock();
+        assert(threadStates[tid] == RUNNING && executorTid == tid && executorInSyscall);
+        ReleaseDomainToken();
+        executorMutex.unlock();
+        PlaceExecutor(tid);
+    } else {
+        assert(token == PARK_SYSCALL);
+        PlaceNonExecutor(tid);
+    }
+    StartSyscallTimer(tid);
+    Execute(tid, true);
 }
 
-// Must be called with executorLock held. Unlocks it. Never returns.
+// Must be called with executorLock held. Unlocks it. Returns once we are the
+// executor, and the caller must then run curTid; never returns if we are
+// woken up to take a syscall.
 void WaitForExecutorRoleOrSyscall(THREADID tid, bool alwaysBlock) {
     // If somebody else is the executor, wait until we're woken up, either
     // because we need to run a syscall or become the executor
-    while (executorTid != -1u || alwaysBlock) {
+    if (executorTid != -1u || alwaysBlock) {
         executorMutex.unlock();
-        waitLocks[tid].lock();
-        executorMutex.lock();
-
-        // A thread may take a syscall either when it's uncaptured or while
-        // still captured **and the executor**. If it's captured and
-        // delayedUncaputreAllowed is set, then another thread returning from a
-        // syscall can perform a delayed uncapture: uncapturing the executor
-        // and claiming the executor role itself. See SyscallGuard for the
-        // delayed uncapture code.
-        bool syscallWhileUncaptured = (threadStates[tid] == UNCAPTURED);
-        bool syscallWhileCaptured = threadStates[tid] == RUNNING &&
-            executorTid == tid && executorInSyscall;
-        if (syscallWhileUncaptured || syscallWhileCaptured) {
-            // Take syscall
-            DEBUG("[%d] WES%d: Wakeup, taking own syscall (%s)", tid, alwaysBlock,
-                    syscallWhileCaptured? "(uncaptured)" : "(captured)");
-            executorMutex.unlock();
-            Execute(tid, true);
-        } else if (executorTid == -1u) {
-            // NOTE: Due to wakeups interleaving with uncaptures, we can have
-            // multiple threads going for the executor. For example, this
-            // thread could have been woken up to claim executor, but a thread
-            // that came out of a syscall got it first. Thus waking up does not
-            // automatically mean executorTid == -1u, so we check.
-            DEBUG("[%d] WES%d: Wakeup to claim executor", tid, alwaysBlock);
-            break;
-        } else {
-            DEBUG("[%d] WES%d: Spurious wakeup", tid, alwaysBlock);
-        }
+        ParkUntilExecutor(tid);
+        return;
     }
 
-    assert(executorTid == -1u);
-
-    // Become executor
+    // Claim the free executor role
     executorTid = tid;
+    if (!executorInSyscall) OpenCaptureQueue();
     assert(curTid < MAX_THREADS);
     DEBUG("[%d] WES%d: Becoming executor, (curTid = %d, capturedThreads = %d)",
             tid, alwaysBlock, curTid, capturedThreads);
     executorMutex.unlock();
+    PlaceExecutor(tid);
+    AcquireDomainToken();  // no-op if the executor role moved within this process
+}
+
+uint32_t WakeFutex(uint64_t addr, uint32_t n, uint32_t bitset);  // see below
+
+// In a fork-server child, exits retire the guest thread without a physical
+// thread to end. Called without executorMutex held, never returns.
+void RetireThreadInline() {
+    executorMutex.lock();
+    uint32_t exitTid = curTid;
+    DEBUG("Fork child: retiring thread %d", exitTid);
+
+    // Do what the kernel does on thread exit, so that joiners wake up
+    volatile uint32_t* clearTid = (volatile uint32_t*)clearTidAddrs[exitTid];
+    if (clearTid) {
+        *clearTid = 0;
+        // Joiners wait in our futex emulation (see EmulateFutex)
+        if (!WakeFutex((uint64_t)clearTid, 1, FUTEX_BITSET_MATCH_ANY)) {
+            syscall(SYS_futex, clearTid, FUTEX_WAKE, 1, NULL, NULL, 0);
+        }
+        SetClearTidAddr(exitTid, 0);
+    }
+
+    if (capturedThreads == 1) {
+        // Last thread, so the process exits
+        threadEndCallback(exitTid);
+        executorMutex.unlock();
+        PIN_ExitApplication(0);
+    }
+
+    UncaptureAndSwitch();  // changes curTid
+    threadEndCallback(exitTid);
+    executorMutex.unlock();
     Execute(curTid, false);
 }
 
-uint64_t RunSyscallGuard(uint64_t executor) {
-    return executor;
+// Runs the syscall in tc from the calling (executor) thread, returns the
+// kernel's result (-errno on failure)
+int64_t RunRawSyscall(const ThreadContext* tc) {
+    int64_t res = syscall(getReg(tc, REG_RAX), getReg(tc, REG_RDI), getReg(tc, REG_RSI),
+            getReg(tc, REG_RDX), getReg(tc, REG_R10), getReg(tc, REG_R8),
+            getReg(tc, REG_R9));
+    return (res == -1)? -errno : res;
 }
 
-void SyscallGuard(THREADID tid, const CONTEXT* ctxt) {
-    executorMutex.lock();
-    DEBUG("[%d] In SyscallGuard() (curTid %d rip 0x%lx er %d)", tid, curTid,
-            PIN_GetContextReg(ctxt, REG_RIP), PIN_GetContextReg(ctxt, tcReg)? 1 : 0);
+// Moves tc past the syscall it's stopped at, mimicking the kernel, which
+// clobbers rcx and r11
+void SkipSyscall(ThreadContext* tc) {
+    uint64_t nextPc = getReg(tc, REG_RIP) + 2;  // syscall is a 2-byte instruction
+    setReg(tc, REG_RCX, nextPc);
+    setReg(tc, REG_R11, getReg(tc, REG_RFLAGS));
+    setReg(tc, REG_RIP, nextPc);
+}
 
-    assert(executorTid == tid);
-    assert(curTid == PIN_GetContextReg(ctxt, tidReg));
+// Continues after the syscall the running thread is stopped at, whose results
+// are already in its tc, by switching to nextTid (usually the same thread).
+// Called without executorMutex held, never returns.
+void FinishSyscallInline(THREADID tid, uint64_t nextTid) {
+    ThreadContext* tc = GetTC(curTid);
+    SkipSyscall(tc);
+    if (syscallExitCallback) syscallExitCallback(curTid, tc);
 
-    // Makes sure the thread's pinCtxt is updated. Depending on the tracing mode,
-    // ctxt may be valid or superfluous
-    CoalesceContext(ctxt, GetTC(curTid));
+    // Treat this like a switch; checks & unsets switchFlags, etc
+    RecordSwitch(tid, tc, nextTid, false);
+    Execute(curTid, false);
+}
 
-    // syscallEnterCallback's return value allows or disallows uncaptures. By
-    // default, every syscall may go through an uncapture/capture cycle so that
-    // the thread may sleep in the kernel without causing the tool to deadlock.
-    // But if they are disallowed, spin stops while the thread is in a syscall.
-    // If the syscall is non-blocking this is safe, and prevents the syscall
-    // from running concurrently with other threads.
-    bool uncaptureAllowed = true;
-    if (syscallEnterCallback) {
-        executorMutex.unlock();
-        ThreadContext* tc = GetTC(curTid);
-        // Update PC, which may be stale in ThreadContext
-        uint64_t pc = getReg(tc, REG_RIP);
-        uncaptureAllowed = syscallEnterCallback(curTid, tc);  // may change tc
+// Pin emulates signal state (handlers, masks, delivery), so these syscalls
+// must go through Pin rather than run raw
+bool IsSignalSyscall(uint64_t nr) {
+    switch (nr) {
+        case SYS_rt_sigaction:
+        case SYS_rt_sigprocmask:
+        case SYS_rt_sigpending:
+        case SYS_rt_sigsuspend:
+        case SYS_rt_sigtimedwait:
+        case SYS_rt_sigreturn:
+        case SYS_sigaltstack:
+        case SYS_tkill:
+        case SYS_tgkill:
+        case SYS_rt_tgsigqueueinfo:
+            return true;
+        default:
+            return false;
+    }
+}
 
-        // Handle jumps
-        if (getReg(tc, REG_RIP) != pc) {
-            DEBUG("syscallEnterCallback changed PC 0x%lx -> %lx (curTid %d), running Execute", pc, getReg(tc, REG_RIP), curTid);
-            // Treat this like a switch; checks & unsets switchFlags, etc
-            RecordSwitch(tid, tc, curTid);
-            Execute(curTid, false);  // does not return
-            panic("??");
+// Continues the running thread after an emulated syscall whose results are
+// already in its tc, if it's our own thread. Instead of an ExecuteAt past the
+// syscall, the syscall instruction runs as a cheap getpid, and the trace
+// guard right after it puts the emulated result back and resumes in place
+// (see TraceGuard). Returns false if it can't (e.g., in slow mode). Called
+// without executorMutex held by the executor.
+bool ContinueThroughSyscall(THREADID tid, CONTEXT* ctxt) {
+    // Switch flags (e.g., an emulator that changed the PC) need RecordSwitch,
+    // and replay expects no syscall return event
+    if (curTid != tid || switchFlags || scheduleMode != SCHED_NONE) return false;
+    ThreadContext* tc = GetTC(tid);
+    uint64_t res = getReg(tc, REG_RAX);
+    setReg(tc, REG_RAX, SYS_getpid);
+    if (!LoadSyscallContext(tid, ctxt)) {
+        setReg(tc, REG_RAX, res);
+        return false;
+    }
+    emulatedResults[tid] = res;
+    emulatedSyscall[tid] = true;
+    return true;
+}
+
+// In a fork-server child, other threads' physical threads are gone, so the
+// executor runs every syscall directly on behalf of the current thread.
+// Syscalls that create or replace threads are unsupported. Futexes are
+// emulated (see SyscallGuard), and signal syscalls go through Pin from the
+// executor's own thread. Called without executorMutex held; returns only to
+// let the syscall instruction run (see LoadSyscallContext).
+void RunSyscallInline(THREADID tid, CONTEXT* ctxt) {
+    ThreadContext* tc = GetTC(curTid);
+    uint64_t nr = getReg(tc, REG_RAX);
+    if (nr == SYS_exit) RetireThreadInline();  // does not return
+    if (nr == SYS_exit_group) PIN_ExitApplication(getReg(tc, REG_RDI));
+    if (nr == SYS_clone || nr == SYS_clone3 || nr == SYS_fork || nr == SYS_vfork || nr == SYS_execve) {
+        panic("[%d] Syscall %ld from thread %d unsupported in fork-server children", tid, nr, curTid);
+    }
+
+    if (IsSignalSyscall(nr)) {
+        // Only our own thread has a physical thread whose signal state Pin
+        // tracks, so take the syscall as an executor that keeps its role
+        // (there are no other physical threads to do a delayed uncapture)
+        if (curTid != tid) {
+            panic("[%d] Signal syscall %ld from thread %d unsupported in fork-server children", tid, nr, curTid);
         }
-        // FIXME(dsm): I suspect this implementation is broken in corner cases:
-        // if some tc reg is changed, that will cause inconsistent switchFlags.
-        // I've left a panic() below that should catch any inconsistency.
-        if (switchFlags) panic("Inconsistent handling of tc writes in syscallEnterCallback()");
         executorMutex.lock();
+        assert(!executorInSyscall);
+        executorInSyscall = true;
+        delayedUncaptureAllowed = false;
+        executorMutex.unlock();
+        if (LoadSyscallContext(tid, ctxt)) return;
+        Execute(tid, true);
     }
 
+    int64_t res = RunRawSyscall(tc);
+    DEBUG("[%d] Fork child: ran syscall %ld inline for %d -> %ld", tid, nr, curTid, res);
+    setReg(tc, REG_RAX, res);
+    FinishSyscallInline(tid, curTid);
+}
+
+/* Futex emulation. All guest code runs on the executor, so futex words change
+ * only when we run, and checking and queueing a waiter is trivially atomic.
+ */
+
+void WakeFutexWaiter(uint32_t waiter) {
+    assert(threadStates[waiter] == BLOCKED);
+    SetThreadState(waiter, IDLE);
+    capturedThreads++;
+    inUncaptureCallback = true;  // like uncaptureCallback, may (un)block threads
+    futexWakeCallback(waiter, false);
+    inUncaptureCallback = false;
+}
+
+uint32_t WakeFutex(uint64_t addr, uint32_t n, uint32_t bitset) {
+    std::vector<uint32_t> woken = futexTable.wake(addr, n, bitset);
+    for (uint32_t w : woken) WakeFutexWaiter(w);
+    return woken.size();
+}
+
+// Wake waiters that went to the kernel, if any; returns how many were woken
+uint32_t WakeKernelFutex(uint64_t addr, uint32_t n, uint32_t bitset, uint32_t privFlag) {
+    if (!kernelFutexWaits || !n) return 0;
+    int64_t res = syscall(SYS_futex, addr, FUTEX_WAKE_BITSET | privFlag, n, NULL, NULL, bitset);
+    return (res > 0)? res : 0;
+}
+
+bool ReadFutexWord(uint64_t addr, uint32_t* val) {
+    return PIN_SafeCopy(val, (const void*)addr, sizeof(uint32_t)) == sizeof(uint32_t);
+}
+
+// FUTEX_WAKE_OP's operation on *addr; returns 0, or -errno like the kernel
+int64_t RunFutexOp(uint64_t addr, uint32_t encodedOp, bool* cmpResult) {
+    uint32_t op = (encodedOp >> 28) & 0x7;
+    uint32_t cmp = (encodedOp >> 24) & 0xf;
+    int32_t oparg = ((int32_t)(encodedOp << 8)) >> 20;  // sign-extended 12 bits
+    int32_t cmparg = ((int32_t)(encodedOp << 20)) >> 20;
+    if (encodedOp & (FUTEX_OP_OPARG_SHIFT << 28)) oparg = 1 << (oparg & 31);
+
+    if (op > FUTEX_OP_XOR) return -ENOSYS;
+    uint32_t oldVal;
+    if (!ReadFutexWord(addr, &oldVal)) return -EFAULT;
+    uint32_t newVal;
+    switch (op) {
+        case FUTEX_OP_SET: newVal = oparg; break;
+        case FUTEX_OP_ADD: newVal = oldVal + oparg; break;
+        case FUTEX_OP_OR: newVal = oldVal | oparg; break;
+        case FUTEX_OP_ANDN: newVal = oldVal & ~oparg; break;
+        default: newVal = oldVal ^ oparg; break;  // FUTEX_OP_XOR
+    }
+    if (PIN_SafeCopy((void*)addr, &newVal, sizeof(uint32_t)) != sizeof(uint32_t)) return -EFAULT;
+
+    int32_t v = oldVal;
+    switch (cmp) {
+        case FUTEX_OP_CMP_EQ: *cmpResult = (v == cmparg); break;
+        case FUTEX_OP_CMP_NE: *cmpResult = (v != cmparg); break;
+        case FUTEX_OP_CMP_LT: *cmpResult = (v < cmparg); break;
+        case FUTEX_OP_CMP_LE: *cmpResult = (v <= cmparg); break;
+        case FUTEX_OP_CMP_GT: *cmpResult = (v > cmparg); break;
+        case FUTEX_OP_CMP_GE: *cmpResult = (v >= cmparg); break;
+        default: return -ENOSYS;  // after the op, like the kernel
+    }
+    return 0;
+}
+
+// Blocks the running thread on addr and switches to the thread the tool
+// picks. Called with executorMutex held. Returns only if there's no other
+// thread to run (the wait must then go to the kernel).
+void BlockOnFutex(THREADID tid, uint64_t addr, uint32_t bitset) {
+    ThreadContext* tc = GetTC(curTid);
+    uint64_t nextTid;
+    if (scheduleMode == SCHED_REPLAY) {
+        ApplyDueScheduleEvents();
+        if (!ScheduleEventDue(EV_FUTEX_WAIT)) return;  // waited in the kernel when recorded
+        nextTid = schedEvents[schedCursor].tid;
+        AdvanceSchedule();
+    } else {
+        if (capturedThreads < 2) return;
+        inUncaptureCallback = true;
+        nextTid = futexWaitCallback(curTid, tc);
+        inUncaptureCallback = false;
+        LogScheduleEvent(EV_FUTEX_WAIT, nextTid);
+    }
+    if (nextTid >= MAX_THREADS || nextTid == curTid || threadStates[nextTid] != IDLE) {
+        panic("[%d] Futex wait callback returned invalid tid %ld (curTid %d)", tid, nextTid, curTid);
+    }
+
+    DEBUG("[%d] Thread %d waits on futex 0x%lx, switching to %ld", tid, curTid, addr, nextTid);
+    futexTable.wait(addr, curTid, bitset);
+    setReg(tc, REG_RAX, 0);  // what the wait returns once woken
+    switchFlags |= SF_BLOCK;  // honored by RecordSwitch
+    executorMutex.unlock();
+    FinishSyscallInline(tid, nextTid);
+}
+
+// Called with executorMutex held from SyscallGuard. Returns if the kernel
+// must run the syscall; otherwise, continues the guest and never returns.
+void EmulateFutex(THREADID tid) {
+    ThreadContext* tc = GetTC(curTid);
+    uint64_t addr = getReg(tc, REG_RDI);
+    uint32_t privFlag = getReg(tc, REG_RSI) & FUTEX_PRIVATE_FLAG;
+    uint32_t op = getReg(tc, REG_RSI) & FUTEX_CMD_MASK;
+    uint32_t val = getReg(tc, REG_RDX);
+    uint64_t val2 = getReg(tc, REG_R10);  // timeout for waits, count for requeues
+    uint64_t addr2 = getReg(tc, REG_R8);
+    uint32_t val3 = getReg(tc, REG_R9);
+    uint32_t curVal;
+
+    // Shared futexes may be used across processes, which only the kernel
+    // sees. Fork-server children have no other physical thread to wait in
+    // the kernel, so they emulate them too (see SyscallGuard).
+    if (!privFlag && !inForkChild) return;
+
+    int64_t res;
+    switch (op) {
+        case FUTEX_WAIT:
+        case FUTEX_WAIT_BITSET: {
+            uint32_t bitset = (op == FUTEX_WAIT)? FUTEX_BITSET_MATCH_ANY : val3;
+            if (!bitset) {
+                res = -EINVAL;
+            } else if (!ReadFutexWord(addr, &curVal)) {
+                res = -EFAULT;
+            } else if (curVal != val) {
+                res = -EAGAIN;
+            } else {
+                // Timed waits, and waits for threads to exit (which the kernel
+                // wakes, e.g., in pthread_join), go to the kernel. Fork-server
+                // children block them all, as they retire threads themselves
+                // and the kernel would block their only physical thread (their
+                // timeouts then only apply if no other thread can run).
+                bool kernelWakes = IsClearTidAddr(addr);
+                if (inForkChild || (!val2 && !kernelWakes)) BlockOnFutex(tid, addr, bitset);  // returns only if it can't block
+                inKernelFutexWait[curTid] = true;
+                kernelFutexWaits++;
+                return;
+            }
+            break;
+        }
+        case FUTEX_WAKE:
+        case FUTEX_WAKE_BITSET: {
+            uint32_t bitset = (op == FUTEX_WAKE)? FUTEX_BITSET_MATCH_ANY : val3;
+            if (!bitset) {
+                res = -EINVAL;
+            } else {
+                res = WakeFutex(addr, val, bitset);
+                res += WakeKernelFutex(addr, val - res, bitset, privFlag);
+            }
+            break;
+        }
+        case FUTEX_REQUEUE:
+        case FUTEX_CMP_REQUEUE: {
+            if (op == FUTEX_CMP_REQUEUE && !ReadFutexWord(addr, &curVal)) {
+                res = -EFAULT;
+            } else if (op == FUTEX_CMP_REQUEUE && curVal != val3) {
+                res = -EAGAIN;
+            } else {
+                uint32_t woken = WakeFutex(addr, val, FUTEX_BITSET_MATCH_ANY);
+                uint32_t requeued = futexTable.requeue(addr, addr2, val2);
+                res = woken + ((op == FUTEX_CMP_REQUEUE)? requeued : 0);
+                // Kernel waiters can't move to our queues, so just wake them
+                res += WakeKernelFutex(addr, val - woken, FUTEX_BITSET_MATCH_ANY, privFlag);
+            }
+            break;
+        }
+        case FUTEX_WAKE_OP: {
+            bool wakeSecond;
+            res = RunFutexOp(addr2, val3, &wakeSecond);
+            if (!res) {
+                res = WakeFutex(addr, val, FUTEX_BITSET_MATCH_ANY);
+                res += WakeKernelFutex(addr, val - res, FUTEX_BITSET_MATCH_ANY, privFlag);
+                if (wakeSecond) {
+                    uint32_t woken2 = WakeFutex(addr2, val2, FUTEX_BITSET_MATCH_ANY);
+                    res += woken2 + WakeKernelFutex(addr2, val2 - woken2, FUTEX_BITSET_MATCH_ANY, privFlag);
+                }
+            }
+            break;
+        }
+        default:
+            return;  // PI futexes and other ops go to the kernel
+    }
+
+    DEBUG("[%d] Emulated futex op %d on 0x%lx for %d -> %ld", tid, op, addr, curTid, res);
+    setReg(tc, REG_RAX, res);
+    executorMutex.unlock();
+    FinishSyscallInline(tid, curTid);
+}
+
+/* I/O offload. The fd table is process-wide, so the executor can issue I/O
+ * syscalls for any thread through io_uring. The issuer stays blocked until
+ * the completion thread reaps its result.
+ */
+
+// Fills sqe with the syscall in tc; returns false if it can't be offloaded
+bool PrepareIoRequest(const ThreadContext* tc, io_uring_sqe* sqe) {
+    memset(sqe, 0, sizeof(io_uring_sqe));
+    uint64_t nr = getReg(tc, REG_RAX);
+    sqe->fd = getReg(tc, REG_RDI);
+    sqe->addr = getReg(tc, REG_RSI);  // buffer, iovec, or msghdr
+    sqe->len = getReg(tc, REG_RDX);  // size or iovec count
+    sqe->off = -1ul;  // use and advance the file position
+    switch (nr) {
+        case SYS_read: sqe->opcode = IORING_OP_READ; break;
+        case SYS_write: sqe->opcode = IORING_OP_WRITE; break;
+        case SYS_readv: sqe->opcode = IORING_OP_READV; break;
+        case SYS_writev: sqe->opcode = IORING_OP_WRITEV; break;
+        case SYS_pread64:
+        case SYS_pwrite64:
+        case SYS_preadv:
+        case SYS_pwritev: {
+            int64_t off = getReg(tc, REG_R10);
+            if (off < 0) return false;  // the kernel fails these, but io_uring would not
+            sqe->off = off;
+            sqe->opcode = (nr == SYS_pread64)? IORING_OP_READ :
+                          (nr == SYS_pwrite64)? IORING_OP_WRITE :
+                          (nr == SYS_preadv)? IORING_OP_READV : IORING_OP_WRITEV;
+            break;
+        }
+        case SYS_sendmsg:
+        case SYS_recvmsg:
+            sqe->opcode = (nr == SYS_sendmsg)? IORING_OP_SENDMSG : IORING_OP_RECVMSG;
+            sqe->msg_flags = getReg(tc, REG_RDX);
+            sqe->len = 1;
+            sqe->off = 0;
+            break;
+        default:
+            return false;
+    }
+    return true;
+}
+
+// Called with executorMutex held from SyscallGuard. Returns if the syscall
+// can't be offloaded; otherwise, blocks the running thread, switches to the
+// thread the tool picks, and never returns.
+void OffloadIo(THREADID tid) {
+    if (capturedThreads < 2 || ioInFlight == IO_RING_ENTRIES) return;
+    ThreadContext* tc = GetTC(curTid);
+    uint32_t ioTid = curTid;
+    io_uring_sqe& sqe = ioRequests[ioTid];
+    if (!PrepareIoRequest(tc, &sqe)) return;
+    sqe.user_data = ioTid;
+
+    inUncaptureCallback = true;
+    uint64_t nextTid = ioBlockCallback(ioTid, tc);
+    inUncaptureCallback = false;
+    if (nextTid >= MAX_THREADS || nextTid == ioTid || threadStates[nextTid] != IDLE) {
+        panic("[%d] I/O block callback returned invalid tid %ld (curTid %d)", tid, nextTid, ioTid);
+    }
+
+    DEBUG("[%d] Offloading syscall %ld of thread %d, switching to %ld", tid, getReg(tc, REG_RAX), ioTid, nextTid);
+    SkipSyscall(tc);  // the completion fills in RAX
+    ioInFlight++;
+    ioPending[ioTid] = true;
+    switchFlags |= SF_BLOCK;  // honored by RecordSwitch
+    executorMutex.unlock();
+    RecordSwitch(tid, tc, nextTid, false);
+
+    // Submit only once the thread is blocked, so its completion can unblock it
+    executorMutex.lock();
+    if (!ioRing.submit(sqe)) panic("I/O offload ring full");
+    executorMutex.unlock();
+    Execute(curTid, false);
+}
+
+// Called from the completion thread with executorMutex held
+void CompleteIo(uint64_t ioTid, int32_t res) {
+    if (res == -ECANCELED) {
+        // The physical thread that submitted it exited first; resubmit it
+        // from the completion thread, which lives until the process exits
+        DEBUG("Resubmitting canceled I/O of thread %ld", ioTid);
+        if (!ioRing.submit(ioRequests[ioTid])) panic("I/O offload ring full");
+        return;
+    }
+
+    ThreadContext* tc = GetTC(ioTid);
+    setReg(tc, REG_RAX, (int64_t)res);
+    ioInFlight--;
+    ioPending[ioTid] = false;
+    if (syscallExitCallback) syscallExitCallback(ioTid, tc);
+
+    assert(threadStates[ioTid] == BLOCKED);
+    SetThreadState(ioTid, IDLE);
+    capturedThreads++;
+    DEBUG("I/O of thread %ld done (%d), %d captured", ioTid, res, capturedThreads);
+    ioCompleteCallback(ioTid, false);
+    NotifyIdleExecutor(ioTid);
+}
+
+void IoCompletionThread(VOID* arg) {
+    while (!ioThreadExit) {
+        // Time out periodically to notice process exit
+        pollfd pfd = {ioRing.getFd(), POLLIN, 0};
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        executorMutex.lock();
+        ioRing.reap(CompleteIo);
+        if (executorInSyscall && delayedUncaptureAllowed && capturedThreads >= 2) {
+            DEBUG("IO: Executor is in syscall, running delayed uncapture");
+            RunDelayedUncapture();
+        }
+        executorMutex.unlock();
+    }
+}
+
+void IoFini(VOID* arg) {
+    ioThreadExit = true;
+    PIN_WaitForThreadTermination(ioThreadUid, PIN_INFINITE_TIMEOUT, nullptr);
+}
+
+/* Virtual time */
+
+#define NS_PER_SEC 1000000000ul
+
+bool IsVirtualClock(int64_t clockId) {
+    switch (clockId) {
+        case CLOCK_REALTIME:
+        case CLOCK_REALTIME_COARSE:
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_MONOTONIC_COARSE:
+        case CLOCK_BOOTTIME:
+            return true;
+        default:
+            return false;  // CPU-time clocks and the like
+    }
+}
+
+bool IsRealtimeClock(int64_t clockId) {
+    return clockId == CLOCK_REALTIME || clockId == CLOCK_REALTIME_COARSE;
+}
+
+uint64_t VirtualNs(ThreadId tid, int64_t clockId) {
+    uint64_t ns = timeCallback(tid);
+    return IsRealtimeClock(clockId)? realtimeBaseNs + ns : ns;
+}
+
+bool WriteGuest(uint64_t addr, const void* val, size_t size) {
+    return PIN_SafeCopy((void*)addr, val, size) == size;
+}
+
+// Answers clock_gettime, gettimeofday, or time (nr) from virtual time. The
+// syscalls and their vDSO versions take the same args, in rdi and rsi.
+// Writes the result to rax and returns true, or returns false if the clock is
+// not virtual.
+bool EmulateTimeCall(ThreadId tid, ThreadContext* tc, uint64_t nr) {
+    uint64_t arg0 = getReg(tc, REG_RDI);
+    uint64_t arg1 = getReg(tc, REG_RSI);
+    int64_t res = 0;
+    if (nr == SYS_clock_gettime) {
+        if (!IsVirtualClock(arg0)) return false;
+        uint64_t ns = VirtualNs(tid, arg0);
+        struct timespec ts = {(time_t)(ns / NS_PER_SEC), (long)(ns % NS_PER_SEC)};
+        if (!WriteGuest(arg1, &ts, sizeof(ts))) res = -EFAULT;
+    } else if (nr == SYS_gettimeofday) {
+        uint64_t ns = VirtualNs(tid, CLOCK_REALTIME);
+        struct timeval tv = {(time_t)(ns / NS_PER_SEC), (suseconds_t)(ns % NS_PER_SEC / 1000)};
+        struct timezone tz = {0, 0};  // UTC
+        if (arg0 && !WriteGuest(arg0, &tv, sizeof(tv))) res = -EFAULT;
+        if (arg1 && !WriteGuest(arg1, &tz, sizeof(tz))) res = -EFAULT;
+    } else if (nr == SYS_time) {
+        time_t t = VirtualNs(tid, CLOCK_REALTIME) / NS_PER_SEC;
+        res = t;
+        if (arg0 && !WriteGuest(arg0, &t, sizeof(t))) res = -EFAULT;
+    } else {
+        return false;
+    }
+    setReg(tc, REG_RAX, res);
+    return true;
+}
+
+bool EmulateTimeSyscall(ThreadId tid, ThreadContext* tc) {
+    return EmulateTimeCall(tid, tc, getReg(tc, REG_RAX));
+}
+
+// Turns nanosleep and clock_nanosleep on virtual clocks into timed blocks
+// (see blockUntil()), and switches to another thread right away, or idles if
+// there is none. Called with executorMutex held from SyscallGuard. Returns
+// if the kernel must run the syscall; otherwise, continues the guest and
+// never returns.
+void EmulateSleep(THREADID tid) {
+    if (scheduleMode != SCHED_NONE) return;
+    ThreadContext* tc = GetTC(curTid);
+    uint64_t nr = getReg(tc, REG_RAX);
+    int64_t clockId = CLOCK_MONOTONIC;
+    bool absolute = false;
+    uint64_t reqAddr = getReg(tc, REG_RDI);
+    if (nr == SYS_clock_nanosleep) {
+        clockId = getReg(tc, REG_RDI);
+        absolute = getReg(tc, REG_RSI) & TIMER_ABSTIME;
+        reqAddr = getReg(tc, REG_RDX);
+    }
+    if (!IsVirtualClock(clockId)) return;
+
+    // Let the kernel fail invalid requests
+    struct timespec req;
+    if (PIN_SafeCopy(&req, (const void*)reqAddr, sizeof(req)) != sizeof(req)) return;
+    if (req.tv_sec < 0 || req.tv_nsec < 0 || req.tv_nsec >= (long)NS_PER_SEC) return;
+    uint64_t reqNs = req.tv_sec * NS_PER_SEC + req.tv_nsec;
+
+    // Timers run on the tool's clock, in monotonic virtual ns
+    uint64_t deadline;
+    if (!absolute) deadline = timeCallback(curTid) + reqNs;
+    else if (!IsRealtimeClock(clockId)) deadline = reqNs;
+    else deadline = (reqNs > realtimeBaseNs)? reqNs - realtimeBaseNs : 0;
+
+    if (deadline <= timerWheel.time()) {
+        DEBUG("[%d] Sleep of thread %d already expired", tid, curTid);
+        setReg(tc, REG_RAX, 0);
+        executorMutex.unlock();
+        FinishSyscallInline(tid, curTid);
+    }
+
+    uint64_t nextTid;
+    if (capturedThreads >= 2) {
+        inUncaptureCallback = true;
+        nextTid = sleepCallback(curTid, tc);
+        inUncaptureCallback = false;
+        if (nextTid >= MAX_THREADS || nextTid == curTid || threadStates[nextTid] != IDLE) {
+            panic("[%d] Sleep callback returned invalid tid %ld (curTid %d)", tid, nextTid, curTid);
+        }
+    } else if (idlingEnabled) {
+        nextTid = curTid;  // block the last runnable thread and idle
+    } else {
+        return;  // nothing else can run, so sleep in host time
+    }
+
+    DEBUG("[%d] Thread %d sleeps until %ld, switching to %ld", tid, curTid, deadline, nextTid);
+    sleeping[curTid] = true;
+    timerWheel.arm(curTid, deadline);
+    setReg(tc, REG_RAX, 0);
+    switchFlags |= SF_BLOCK;  // honored by RecordSwitch
+    executorMutex.unlock();
+    FinishSyscallInline(tid, nextTid);
+}
+
+// Analysis routine after RDTSC and RDTSCP, before fast mode saves the regs
+void VirtualRdtsc(uint32_t tid, PIN_REGISTER* rax, PIN_REGISTER* rdx) {
+    uint64_t ns = timeCallback(tid);
+    uint64_t tsc = ns / 1000 * tscMHz + ns % 1000 * tscMHz / 1000;
+    rax->qword[0] = tsc & 0xffffffff;
+    rdx->qword[0] = tsc >> 32;
+}
+
+// RDTSCP also returns TSC_AUX in ECX, which Linux sets to the host CPU (and
+// NUMA node). All guest threads run on the single executor, so report CPU 0,
+// as where the executor's physical thread runs is not guest-visible state.
+void VirtualRdtscp(uint32_t tid, PIN_REGISTER* rax, PIN_REGISTER* rdx, PIN_REGISTER* rcx) {
+    VirtualRdtsc(tid, rax, rdx);
+    rcx->qword[0] = 0;
+}
+
+void InsertVirtualRdtscCalls(TRACE trace) {
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            xed_iclass_enum_t op = (xed_iclass_enum_t)INS_Opcode(ins);
+            if (op == XED_ICLASS_RDTSC) {
+                INS_InsertCall(ins, IPOINT_AFTER, (AFUNPTR)VirtualRdtsc, IARG_REG_VALUE, tidReg,
+                        IARG_REG_REFERENCE, REG_RAX, IARG_REG_REFERENCE, REG_RDX,
+                        IARG_CALL_ORDER, CALL_ORDER_FIRST - 1, IARG_END);
+            } else if (op == XED_ICLASS_RDTSCP) {
+                INS_InsertCall(ins, IPOINT_AFTER, (AFUNPTR)VirtualRdtscp, IARG_REG_VALUE, tidReg,
+                        IARG_REG_REFERENCE, REG_RAX, IARG_REG_REFERENCE, REG_RDX,
+                        IARG_REG_REFERENCE, REG_RCX,
+                        IARG_CALL_ORDER, CALL_ORDER_FIRST - 1, IARG_END);
+            }
+        }
+    }
+}
+
+// Switchcall at the entry of a vDSO time function: emulates it and returns
+// to its caller, or lets it run if its clock is not virtual
+uint64_t VdsoSwitchcall(uint32_t tid, ThreadContext* tc, ADDRINT pc) {
+    if (!EmulateTimeCall(tid, tc, vdsoEntries[pc])) return tid;
+    uint64_t rsp = getReg(tc, REG_RSP);
+    uint64_t retPc;
+    if (PIN_SafeCopy(&retPc, (const void*)rsp, sizeof(retPc)) != sizeof(retPc)) {
+        panic("[%d] Could not read return address of vDSO call at 0x%lx", tid, pc);
+    }
+    setReg(tc, REG_RSP, rsp + sizeof(retPc));
+    setReg(tc, REG_RIP, retPc);  // switches to the same thread at the new PC
+    return tid;
+}
+
+void InsertVdsoSwitchCalls(TRACE trace, TraceInfo& pt) {
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        INS ins = BBL_InsHead(bbl);
+        if (!vdsoEntries.count(INS_Address(ins))) continue;
+        auto toolSwitchpoint = std::find_if(pt.switchpoints.begin(), pt.switchpoints.end(),
+                [ins](const CallpointVector::value_type& sp) { return std::get<0>(sp) == ins; });
+        if (toolSwitchpoint == pt.switchpoints.end()) {
+            pt.insertSwitchCall(ins, IPOINT_BEFORE, (AFUNPTR)VdsoSwitchcall,
+                    IARG_SPIN_THREAD_ID, IARG_SPIN_CONTEXT, IARG_REG_VALUE, REG_RIP);
+            continue;
+        }
+
+        // Only one switchcall per instruction is supported, so chain with the
+        // tool's: emulate first, then run its switchcall. If the call was
+        // emulated, the tool sees the thread at the return address, and if
+        // it returns the same thread, the PC change still switches to it.
+        std::function<void()> toolCall = std::get<2>(*toolSwitchpoint);
+        std::get<2>(*toolSwitchpoint) = [ins, toolCall]() {
+            INS_InsertCall(ins, IPOINT_BEFORE, (AFUNPTR)VdsoSwitchcall,
+                    IARG_SPIN_THREAD_ID, IARG_SPIN_CONTEXT, IARG_REG_VALUE, REG_RIP, IARG_END);
+            toolCall();
+        };
+        // Slow mode must save the context for the emulation to see it
+        pt.switchpointContexts[toolSwitchpoint - pt.switchpoints.begin()] = true;
+    }
+}
+
+void FindVdsoEntries(IMG img, VOID* v) {
+    if (!IMG_IsVDSO(img)) return;
+    const std::pair<const char*, uint64_t> entries[] = {
+        {"__vdso_clock_gettime", SYS_clock_gettime},
+        {"__vdso_gettimeofday", SYS_gettimeofday},
+        {"__vdso_time", SYS_time},
+    };
+    for (auto& e : entries) {
+        RTN rtn = RTN_FindByName(img, e.first);
+        if (RTN_Valid(rtn)) vdsoEntries[RTN_Address(rtn)] = e.second;
+    }
+    DEBUG("Found %ld vDSO time functions", vdsoEntries.size());
+}
+
+uint64_t RunSyscallGuard(uint64_t executor) {
+    return executor;
+}
+
+// ctxt may be a partial context (see InsertSyscallGuard)
+void SyscallGuard(THREADID tid, CONTEXT* ctxt) {
+    executorMutex.lock();
+    DEBUG("[%d] In SyscallGuard() (curTid %d rip 0x%lx er %d)", tid, curTid,
+            PIN_GetContextReg(ctxt, REG_RIP), PIN_GetContextReg(ctxt, tcReg)? 1 : 0);
+
+    assert(executorTid == tid);
+    assert(curTid == PIN_GetContextReg(ctxt, tidReg));
+
+    // We may stay in the kernel for long, so capture queued threads now, and
+    // have others take the slow path until some executor runs guest code
+    // again (paths that keep running guest code reopen it on their switch)
+    DrainCaptureQueue(true);
+
+    // Makes sure the thread's pinCtxt is updated. Depending on the tracing mode,
+    // ctxt may be valid or superfluous
+    CoalesceContext(ctxt, GetTC(curTid));
+
+    // syscallEnterCallback's return value allows or disallows uncaptures. By
+    // default, every syscall may go through an uncapture/capture cycle so that
+    // the thread may sleep in the kernel without causing the tool to deadlock.
+    // But if they are disallowed, spin stops while the thread is in a syscall.
+    // If the syscall is non-blocking this is safe, and prevents the syscall
+    // from running concurrently with other threads.
+    bool uncaptureAllowed = true;
+    if (syscallEnterCallback) {
+        executorMutex.unlock();
+        ThreadContext* tc = GetTC(curTid);
+        // Update PC, which may be stale in ThreadContext
+        uint64_t pc = getReg(tc, REG_RIP);
+        uncaptureAllowed = syscallEnterCallback(curTid, tc);  // may change tc
+
+        // Handle jumps
+        if (getReg(tc, REG_RIP) != pc) {
+            DEBUG("syscallEnterCallback changed PC 0x%lx -> %lx (curTid %d), running Execute", pc, getReg(tc, REG_RIP), curTid);
+            // Treat this like a switch; checks & unsets switchFlags, etc
+            RecordSwitch(tid, tc, curTid, false);
+            Execute(curTid, false);  // does not return
+            panic("??");
+        }
+        // FIXME(dsm): I suspect this implementation is broken in corner cases:
+        // if some tc reg is changed, that will cause inconsistent switchFlags.
+        // I've left a panic() below that should catch any inconsistency.
+        if (switchFlags) panic("Inconsistent handling of tc writes in syscallEnterCallback()");
+        executorMutex.lock();
+    }
+
+    uint64_t nr = getReg(GetTC(curTid), REG_RAX);
+    if (nr == SYS_set_tid_address) {
+        SetClearTidAddr(curTid, getReg(GetTC(curTid), REG_RDI));
+    }
+
+    // Emulated syscalls run right here, without uncapturing the thread
+    if (nr < MAX_SYSCALLS && syscallEmulators[nr]) {
+        executorMutex.unlock();
+        if (syscallEmulators[nr](curTid, GetTC(curTid))) {
+            DEBUG("[%d] SG: Emulated syscall %ld for %d", tid, nr, curTid);
+            if (ContinueThroughSyscall(tid, ctxt)) return;
+            FinishSyscallInline(tid, curTid);  // does not return
+        }
+        executorMutex.lock();
+    }
+
+    // Fork-server children always emulate futexes, as a thread waiting in the
+    // kernel would block the only physical thread, and no one could wake it
+    if (nr == SYS_futex && (futexEmulation || inForkChild)) EmulateFutex(tid);  // returns if the kernel must run it
+    if ((nr == SYS_nanosleep || nr == SYS_clock_nanosleep) && timeCallback) EmulateSleep(tid);  // ditto
+
+    // Completions are not recorded, so offload only outside record/replay
+    if (ioOffload && uncaptureAllowed && scheduleMode == SCHED_NONE) OffloadIo(tid);  // returns if it can't
+
+    if (unlikely(inForkChild)) {
+        executorMutex.unlock();
+        RunSyscallInline(tid, ctxt);
+        return;
+    }
+
+    if (nr == SYS_clone || nr == SYS_clone3) RecordCloneArgs(curTid, GetTC(curTid), nr);
+
+    syscallNrs[curTid] = nr;
+    stats.syscalls++;
+    threadStats[curTid].syscalls++;
+
     if (curTid != tid) {
         // We need to ship off this syscall and move on to another thread
         if (capturedThreads >= 2 && uncaptureAllowed) {
             // Both us and the tid we're running are captured and unblocked
             uint32_t wakeTid = curTid;
+            stats.shippedSyscalls++;
+            threadStats[wakeTid].shippedSyscalls++;
             UncaptureAndSwitch();  // changes curTid
-            waitLocks[wakeTid].unlock();  // wake syscall taker
+            parkingSlots[wakeTid].unpark(PARK_SYSCALL);  // wake syscall taker
             DEBUG("[%d] SG: Shipping syscall to real tid %d, running %d", tid, wakeTid, curTid);
             executorMutex.unlock();
             Execute(curTid, false);
@@ -399,53 +1906,265 @@ void SyscallGuard(THREADID tid, const CONTEXT* ctxt) {
 
             // 2. Wake the other thread (who's in WaitForExecutor, see the matching logic there)
             DEBUG("[%d] SG: Waking real tid %d to run its syscall, and blocking ourselves", tid, curTid);
-            waitLocks[curTid].unlock();  // wake new executor
+            parkingSlots[curTid].unpark(PARK_CAPTURED_SYSCALL);  // wake new executor
 
             // 3. Block, as we are a blocked thread
             WaitForExecutorRoleOrSyscall(tid, true /*always block*/);
+            Execute(curTid, false);
         }
     } else {
-        // We ourselves need to take the syscall...
-        if (capturedThreads >= 2 && uncaptureAllowed) {
+        // We ourselves need to take the syscall... Short ones keep the
+        // executor role (other threads wait, but only briefly), avoiding a
+        // handoff to another physical thread. Another thread's syscall (above)
+        // needs its physical thread to take over anyway, so it's always shipped.
+        bool keepExecutor = capturedThreads >= 2 && uncaptureAllowed && KeepsExecutor(nr);
+        if (keepExecutor) {
+            syscallProfiles[nr].stats.keptCount++;
+            stats.keptSyscalls++;
+        }
+        if (capturedThreads >= 2 && uncaptureAllowed && !keepExecutor) {
             // 2. Wake up another idle thread to continue execution
             // Instead of searching for an idle non-executor thread, we
             // leverage that the thread we switch to must be captured, and make
             // that the executor as well.
+            stats.shippedSyscalls++;
+            threadStats[tid].shippedSyscalls++;
             UncaptureAndSwitch();  // changes curTid
-            executorTid = -1u;
             DEBUG("[%d] SG: Waking real tid %d, now running %d, and going to syscall", tid, curTid, curTid);
-            waitLocks[curTid].unlock();  // wake new executor
+            HandOffExecutor(curTid);
         } else {
-            // 3. We're the only captured thread, so if we uncaptured ourselves
-            // the tool would run out of threads. Instead, let the first
-            // captured thread do a delayed uncapture (if allowed). Otherwise,
-            // we'll resume execution ourselves after the syscall.
+            // 3. We're the only captured thread, so if we uncaptured
+            // ourselves the tool would run out of threads. Instead, let the
+            // first captured thread do a delayed uncapture (if allowed).
+            // Otherwise, we'll resume execution ourselves after the syscall.
+            // A kept syscall is only uncaptured by the watchdog, if it blocks.
             DEBUG("[%d] SG: Delayed uncapture", tid);
             assert(!executorInSyscall);
             executorInSyscall = true;
-            delayedUncaptureAllowed = uncaptureAllowed;
+            delayedUncaptureAllowed = uncaptureAllowed && !keepExecutor;
+            executorKeptSyscall = keepExecutor;
+            if (keepExecutor) SpawnWatchdog();
         }
 
+        if (executorInSyscall) ReleaseDomainToken();  // see WaitForExecutorRoleOrSyscall
+        StartSyscallTimer(tid);
+        bool shipped = !executorInSyscall;
         executorMutex.unlock();
+        if (shipped) PlaceNonExecutor(tid);
 
-        // Take our syscall
+        // Take our syscall. Fast mode loads our context into the registers
+        // and lets the syscall instruction run; otherwise, switch it in.
+        if (LoadSyscallContext(tid, ctxt)) return;
         Execute(tid, true);
     }
 }
 
 // Should inline, avoid conditionals. Note use of | instead of || and - instead of !=
 uint64_t NeedsSwitch(uint64_t curTid, uint64_t nextTid) {
-    return (nextTid - curTid) | switchFlags;
+    // Also "switch" to the same thread to drain queued captures
+    return (nextTid - curTid) | switchFlags | (captureQueue >= CQ_FIRST_TID);
+}
+
+// Called from RecordSwitch when the last runnable thread blocked. Waits,
+// with the executor role but no running thread, until a thread is runnable
+// and returns it, marked RUNNING. Releases executorMutex while waiting.
+uint32_t IdleUntilRunnable() {
+    assert(capturedThreads == 0);
+    DEBUG("Executor idle after blocking thread %d", curTid);
+    curTid = -1u;
+    idleNextTid = -1u;
+    executorIdle = true;
+    // Later captures take TraceGuard's slow path, which gives them runsNext
+    DrainCaptureQueue(true);
+    ReleaseDomainToken();
+
+    // A capture with runsNext sets curTid itself (see TraceGuard)
+    while (curTid == -1u) {
+        uint32_t seq = idleEvents;
+        uint32_t next = -1u;
+        if (idleCallback) {
+            executorMutex.unlock();
+            next = idleCallback();
+            executorMutex.lock();
+            if (curTid != -1u) break;
+            if (next != -1u && (next >= MAX_THREADS || threadStates[next] != IDLE)) {
+                panic("Idle callback returned invalid tid %d (state %d)", next,
+                        (next < MAX_THREADS)? threadStates[next] : -1);
+            }
+        }
+        // Threads unblocked and blocked again before we got to them are skipped
+        if (next == -1u && idleNextTid != -1u && threadStates[idleNextTid] == IDLE) next = idleNextTid;
+        idleNextTid = -1u;
+        if (next != -1u) {
+            curTid = next;
+            SetThreadState(curTid, RUNNING);
+            break;
+        }
+
+        executorMutex.unlock();
+        syscall(SYS_futex, &idleEvents, FUTEX_WAIT, seq, NULL, NULL, 0);
+        executorMutex.lock();
+    }
+    executorIdle = false;
+    DEBUG("Executor leaves idle, running %d", curTid);
+
+    // Other processes in the domain may have run meanwhile
+    executorMutex.unlock();
+    AcquireDomainToken();
+    executorMutex.lock();
+    return curTid;
+}
+
+/* Code cache eviction (see enableTraceEviction()). Traces are recorded by
+ * address range when instrumented, and each one counts its runs from its
+ * head. Every EPOCH_SWITCHES switches, the executor samples the counters and
+ * stamps the traces that ran with the current epoch. Traces not stamped for
+ * coldEpochs epochs are cold. Records are protected by evictionMutex, as Pin
+ * instruments traces outside executorMutex, and are never freed, so their
+ * counters outlive the code that bumps them.
+ */
+struct TraceRecord {
+    ADDRINT end;
+    uint64_t runs;  // bumped by the trace's code (see CountTraceRun())
+    uint64_t sampledRuns;
+    uint64_t lastEpoch;
+    bool cached;  // not evicted or flushed since it was last instrumented
+};
+
+static const uint64_t EPOCH_SWITCHES = 16384;
+
+bool evictionEnabled = false;
+uint32_t evictionHighWaterPct;
+uint64_t coldEpochs;
+spin_mutex evictionMutex;
+std::map<ADDRINT, TraceRecord> traceRecords;  // by start address
+uint64_t evictionSwitches = 0;
+uint64_t evictionEpoch = 0;
+uint64_t lastEvictionEpoch = 0;
+volatile bool evictionRequested = false;  // by instrumentation, see RecordTrace()
+std::vector<std::pair<ADDRINT, ADDRINT>> pendingInvalidations;  // under executorMutex
+TraceEvictionStats evictionStats = {};
+
+void CountTraceRun(uint64_t* runs) {
+    (*runs)++;
+}
+
+// Called from InstrumentTrace. Records the trace and counts its runs, and
+// once the code cache passes the high-water mark (at most once per epoch),
+// asks the executor to evict cold traces. Pin does not allow invalidating
+// code from instrumentation callbacks, so evictions wait for the next switch.
+void RecordTrace(TRACE trace) {
+    scoped_mutex sm(evictionMutex);
+    ADDRINT start = TRACE_Address(trace);
+    TraceRecord& rec = traceRecords[start];
+    rec.end = std::max(rec.end, start + TRACE_Size(trace));
+    if (!rec.cached) {
+        rec.cached = true;
+        rec.sampledRuns = rec.runs;
+        rec.lastEpoch = evictionEpoch;
+    }
+    INS_InsertCall(BBL_InsHead(TRACE_BblHead(trace)), IPOINT_BEFORE, (AFUNPTR)CountTraceRun,
+            IARG_PTR, &rec.runs, IARG_END);
+
+    uint64_t used = CODECACHE_CodeMemUsed();
+    uint64_t limit = CODECACHE_CacheSizeLimit();
+    if (used * 100 >= limit * evictionHighWaterPct && evictionEpoch != lastEvictionEpoch) {
+        evictionRequested = true;
+    }
+}
+
+// Stamps traces that ran since the last sample. Called with evictionMutex held.
+void SampleTraceRuns() {
+    for (auto& tr : traceRecords) {
+        TraceRecord& rec = tr.second;
+        if (rec.runs != rec.sampledRuns) {
+            rec.sampledRuns = rec.runs;
+            rec.lastEpoch = evictionEpoch;
+        }
+    }
+}
+
+// Picks cold traces to invalidate, coalescing overlapping ones into ranges.
+// Pin invalidates every trace that overlaps a range, so cold traces that
+// overlap hot ones are kept. Called with evictionMutex held.
+void FindColdRanges() {
+    // Hot code, as sorted disjoint intervals
+    std::vector<std::pair<ADDRINT, ADDRINT>> hot;
+    for (auto& tr : traceRecords) {
+        const TraceRecord& rec = tr.second;
+        if (!rec.cached || evictionEpoch - rec.lastEpoch >= coldEpochs) continue;
+        if (!hot.empty() && tr.first <= hot.back().second) hot.back().second = std::max(hot.back().second, rec.end);
+        else hot.push_back(std::make_pair(tr.first, rec.end));
+    }
+    auto overlapsHot = [&hot](ADDRINT start, ADDRINT end) {
+        auto it = std::lower_bound(hot.begin(), hot.end(), start,
+                [](const std::pair<ADDRINT, ADDRINT>& h, ADDRINT a) { return h.second <= a; });
+        return it != hot.end() && it->first < end;
+    };
+
+    ADDRINT rangeStart = 0, rangeEnd = 0;
+    uint64_t traces = 0;
+    auto closeRange = [&]() {
+        if (rangeEnd != rangeStart) pendingInvalidations.push_back(std::make_pair(rangeStart, rangeEnd));
+        rangeStart = rangeEnd = 0;
+    };
+    for (auto& tr : traceRecords) {
+        TraceRecord& rec = tr.second;
+        if (!rec.cached || evictionEpoch - rec.lastEpoch < coldEpochs) continue;
+        if (overlapsHot(tr.first, rec.end)) continue;
+        if (tr.first > rangeEnd) closeRange();
+        if (rangeEnd == rangeStart) rangeStart = tr.first;
+        rangeEnd = std::max(rangeEnd, rec.end);
+        rec.cached = false;
+        traces++;
+    }
+    closeRange();
+    evictionStats.passes++;
+    evictionStats.tracesEvicted += traces;
+    evictionStats.rangesInvalidated += pendingInvalidations.size();
+    info("Evicting %ld cold traces in %ld ranges (%d/%d KB of code cache used)",
+            traces, pendingInvalidations.size(), CODECACHE_CodeMemUsed() >> 10, CODECACHE_CacheSizeLimit() >> 10);
+}
+
+// Called with executorMutex held from RecordSwitch
+void EvictionSwitchpoint() {
+    bool epochEnds = ++evictionSwitches % EPOCH_SWITCHES == 0;
+    if (!epochEnds && !evictionRequested) return;
+    scoped_mutex sm(evictionMutex);
+    SampleTraceRuns();
+    if (evictionRequested) {
+        // The switching thread's trace just ran, so it is hot
+        evictionRequested = false;
+        lastEvictionEpoch = evictionEpoch;
+        FindColdRanges();
+    }
+    if (epochEnds) evictionEpoch++;
+}
+
+// Called from RecordSwitch, an analysis routine, without libspin's locks
+// held, as Pin may need to stop instrumenting threads to invalidate
+void InvalidateColdRanges(const std::vector<std::pair<ADDRINT, ADDRINT>>& ranges) {
+    for (auto& range : ranges) CODECACHE_InvalidateRange(range.first, range.second - 1);
 }
 
-void RecordSwitch(THREADID tid, ThreadContext* tc, uint64_t nextTid) {
+void TraceEvictionFlushed() {
+    scoped_mutex sm(evictionMutex);
+    for (auto& tr : traceRecords) tr.second.cached = false;
+}
+
+uint64_t RecordSwitch(THREADID tid, ThreadContext* tc, uint64_t nextTid, bool atSwitchpoint) {
     executorMutex.lock();
     if (!tc) {
         panic("[%d] I was supposed to be the executor?? But it's %d", tid, executorTid);
     }
-    if ((switchFlags & SF_BLOCK) && nextTid == curTid) {
+    bool idles = (switchFlags & SF_BLOCK) && nextTid == curTid;
+    if (idles && !idlingEnabled) {
         panic("[%d] Switchcall from thread %d called blockAfterSwitch(), but returned the same thread!", tid, curTid);
     }
+    if (idles && (capturedThreads != 1 || scheduleMode != SCHED_NONE)) {
+        panic("[%d] Switchcall from thread %d blocked it and idled, but it is not the last runnable "
+                "thread (%d captured), or schedules are recorded or replayed", tid, curTid, capturedThreads);
+    }
     if ((switchFlags & SF_SETLIVEREG) && !(switchFlags & SF_SETPC)) {
         panic("[%d] Switchcall from thread %d called setReg() on the live context, but did not set a new PC. Unsupported in slow mode!", tid, curTid);
     }
@@ -454,26 +2173,39 @@ void RecordSwitch(THREADID tid, ThreadContext* tc, uint64_t nextTid) {
     assert(curTid <= MAX_THREADS);
 
     assert(threadStates[curTid] == RUNNING);
-    threadStates[curTid] = IDLE;
+    SetThreadState(curTid, IDLE);
+    if (evictionEnabled) EvictionSwitchpoint();
 
-    if (nextTid >= MAX_THREADS || threadStates[nextTid] != IDLE) {
+    if (!idles && (nextTid >= MAX_THREADS || threadStates[nextTid] != IDLE)) {
         panic("[%d] Switchcall returned invalid next tid %d (state %d)", tid,
                 nextTid, (nextTid < MAX_THREADS)? threadStates[nextTid] : -1);
     }
 
     DEBUG_SWITCH("[%d] Switching %d -> %d (%p -> %p)", tid, curTid, nextTid,
                  getReg(tc, REG_RIP), getReg(getContext(nextTid), REG_RIP));
+    if (atSwitchpoint) LogScheduleEvent((switchFlags & SF_BLOCK)? EV_SWITCH_BLOCK : EV_SWITCH, nextTid);
     if (switchFlags & SF_BLOCK) {
         DEBUG("[%d] Blocking %d at switch", tid, curTid);
-        threadStates[curTid] = BLOCKED;
-        assert(capturedThreads > 1);
+        SetThreadState(curTid, BLOCKED);
+        assert(capturedThreads > 1 || idles);
         capturedThreads--;
     }
 
     switchFlags = SF_NONE;
+    uint32_t prevTid = curTid;
+    if (idles) nextTid = IdleUntilRunnable();  // may release executorMutex
     curTid = nextTid;
-    threadStates[curTid] = RUNNING;
+    SetThreadState(curTid, RUNNING);
+    if (curTid != prevTid) {
+        stats.switches++;
+        threadStats[curTid].switchesIn++;
+    }
+    DrainCaptureQueue(!CaptureQueueAllowed());
+    std::vector<std::pair<ADDRINT, ADDRINT>> invalidations;
+    if (unlikely(!pendingInvalidations.empty())) invalidations.swap(pendingInvalidations);
     executorMutex.unlock();
+    if (unlikely(!invalidations.empty())) InvalidateColdRanges(invalidations);
+    return nextTid;
 }
 
 void NotifySetPC(uint32_t tid) {
@@ -491,8 +2223,147 @@ void NotifySetLiveReg() {
     switchFlags |= SF_SETLIVEREG;
 }
 
+void NotifySetUndoMode(uint32_t tid) {
+    if (tid == curTid) switchFlags |= SF_SETMODE;
+}
+
+bool IsUndoModeSwitch(uint64_t nextTid) {
+    return switchFlags == SF_SETMODE && nextTid == curTid;
+}
+
+bool IsCaptureOnlySwitch(uint64_t nextTid) {
+    return switchFlags == SF_NONE && nextTid == curTid;
+}
+
 /* Instrumentation */
 
+uint64_t SpinSwitchcall(uint32_t tid, ADDRINT pc) {
+    return spinCallback(tid, pc);
+}
+
+// Whether a loop body carries register values across iterations, e.g., a
+// counter or a pointer it advances (as in a reduction over an array), i.e.,
+// some register is read before the iteration writes it but written later.
+// Flags and the PC do not count, as a spin-wait recomputes them.
+bool LoopMakesRegProgress(const std::vector<INS>& loop) {
+    auto isProgressReg = [](REG r) {
+        return REG_valid(r) && r != REG_RFLAGS && r != REG_RIP;
+    };
+    std::set<REG> written;
+    for (INS ins : loop) {
+        for (uint32_t i = 0; i < INS_MaxNumWRegs(ins); i++) {
+            REG r = REG_FullRegName(INS_RegW(ins, i));
+            if (isProgressReg(r)) written.insert(r);
+        }
+    }
+
+    std::set<REG> writtenThisIter;
+    for (INS ins : loop) {
+        for (uint32_t i = 0; i < INS_MaxNumRRegs(ins); i++) {
+            REG r = REG_FullRegName(INS_RegR(ins, i));
+            if (isProgressReg(r) && written.count(r) && !writtenThisIter.count(r)) return true;
+        }
+        for (uint32_t i = 0; i < INS_MaxNumWRegs(ins); i++) {
+            writtenThisIter.insert(REG_FullRegName(INS_RegW(ins, i)));
+        }
+    }
+    return false;
+}
+
+// Returns the instructions where spin-waits should yield: PAUSEs and, if
+// enabled, the heads of short backward-branching loops that read memory but
+// do not write it or carry registers across iterations (e.g., while (*flag
+// == 0);). Such loops can only exit once some other thread runs.
+std::vector<INS> FindSpinWaits(TRACE trace) {
+    std::vector<INS> traceIns;
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
+            traceIns.push_back(ins);
+        }
+    }
+
+    std::vector<INS> spinIns;
+    auto addSpinIns = [&spinIns](INS ins) {
+        if (std::find(spinIns.begin(), spinIns.end(), ins) == spinIns.end()) spinIns.push_back(ins);
+    };
+    for (uint32_t i = 0; i < traceIns.size(); i++) {
+        INS ins = traceIns[i];
+        if (INS_Opcode(ins) == XED_ICLASS_PAUSE) {
+            addSpinIns(ins);
+            continue;
+        }
+        if (!detectSpinLoops || !INS_IsDirectBranch(ins) || !INS_HasFallThrough(ins)) continue;
+
+        // Look for the loop head among the few preceding instructions
+        ADDRINT target = INS_DirectBranchOrCallTargetAddress(ins);
+        uint32_t head = i;
+        while (head > 0 && i - head < MAX_SPIN_LOOP_INSTRS && INS_Address(traceIns[head]) != target) head--;
+        if (INS_Address(traceIns[head]) != target) continue;
+
+        bool reads = false;
+        bool sideEffects = false;
+        std::vector<INS> loop(traceIns.begin() + head, traceIns.begin() + i + 1);
+        for (INS loopIns : loop) {
+            reads |= INS_IsMemoryRead(loopIns);
+            sideEffects |= INS_IsMemoryWrite(loopIns) || INS_IsCall(loopIns) || INS_IsSyscall(loopIns);
+        }
+        if (reads && !sideEffects && !LoopMakesRegProgress(loop)) addSpinIns(traceIns[head]);
+    }
+    return spinIns;
+}
+
+void InsertSpinSwitchCalls(TRACE trace, TraceInfo& pt) {
+    for (INS ins : FindSpinWaits(trace)) {
+        // The tool's own switchcall already lets this thread yield here
+        auto toolSwitchpoint = std::find_if(pt.switchpoints.begin(), pt.switchpoints.end(),
+                [ins](const CallpointVector::value_type& sp) { return std::get<0>(sp) == ins; });
+        if (toolSwitchpoint != pt.switchpoints.end()) continue;
+        pt.insertSwitchCall(ins, IPOINT_BEFORE, (AFUNPTR)SpinSwitchcall,
+                IARG_SPIN_THREAD_ID, IARG_REG_VALUE, REG_RIP);
+    }
+}
+
+/* Code footprint policy (see enableCodePressurePolicy()). Runs from
+ * InstrumentTrace, which Pin serializes.
+ */
+static const uint32_t PRESSURE_CHECK_TRACES = 256;
+
+bool pressurePolicyEnabled = false;
+CodePressureCallback pressureCallback = nullptr;
+uint32_t compactPct, coarsePct;
+uint64_t maxPinMemGrowth;  // bytes per second
+uint32_t tracesSincePressureCheck = 0;
+uint64_t lastPressureCheckNs = 0;
+uint64_t lastPressureCheckPinMem = 0;
+
+void SetCodePressure(CodePressure level) {
+    if (level <= codePressure) return;
+    info("Code cache pressure: level %d -> %d (%d/%d KB used, PIN mem %d KB)",
+            codePressure, level, CODECACHE_CodeMemUsed() >> 10,
+            CODECACHE_CacheSizeLimit() >> 10, PIN_MemoryAllocatedForPin() >> 10);
+    codePressure = level;
+    if (pressureCallback) pressureCallback(level);
+}
+
+void CheckCodePressure() {
+    if (++tracesSincePressureCheck < PRESSURE_CHECK_TRACES) return;
+    tracesSincePressureCheck = 0;
+
+    uint64_t used = CODECACHE_CodeMemUsed();
+    uint64_t limit = CODECACHE_CacheSizeLimit();
+    if (used * 100 >= limit * coarsePct) SetCodePressure(PRESSURE_COARSE);
+    else if (used * 100 >= limit * compactPct) SetCodePressure(PRESSURE_COMPACT);
+
+    uint64_t now = MonotonicNs();
+    uint64_t pinMem = PIN_MemoryAllocatedForPin();
+    if (lastPressureCheckNs && now > lastPressureCheckNs && pinMem > lastPressureCheckPinMem) {
+        uint64_t growth = (pinMem - lastPressureCheckPinMem) * 1000000000ul / (now - lastPressureCheckNs);
+        if (growth > maxPinMemGrowth) SetCodePressure(PRESSURE_COMPACT);
+    }
+    lastPressureCheckNs = now;
+    lastPressureCheckPinMem = pinMem;
+}
+
 void InstrumentTrace(TRACE trace, VOID *v) {
     // If we're one block away from filling up the code cache, force a flush.
     // We need this because Pin does not flush the cache while threads are
@@ -510,6 +2381,9 @@ void InstrumentTrace(TRACE trace, VOID *v) {
     // flags---changing them at initialization using the CodeCache API causes
     // Pin to misbehave.
     //
+    // With enableTraceEviction(), cold traces are invalidated well before
+    // this point (see RecordTrace()), so this flush is a backstop.
+    //
     // NOTE: At least on Pin 2.14 / 71293, this memory leak does NOT depend on
     // the flushes being forced. I implemented a much more complex solution
     // that uses PIN_IsActionPending(tid) to wake all non-executor threads,
@@ -524,7 +2398,14 @@ void InstrumentTrace(TRACE trace, VOID *v) {
              codeCacheUsed >> 10, codeCacheLimit >> 10,
              PIN_MemoryAllocatedForPin() >> 10);
         CODECACHE_FlushCache();
+        evictionStats.fullFlushes++;
+        stats.forcedFlushes++;
+        if (pressurePolicyEnabled && codePressure < PRESSURE_COARSE) {
+            SetCodePressure((CodePressure)(codePressure + 1));
+        }
     }
+    if (evictionEnabled) RecordTrace(trace);
+    if (pressurePolicyEnabled) CheckCodePressure();
 
     INS firstIns = BBL_InsHead(TRACE_BblHead(trace));
     bool isSyscallTrace = INS_IsSyscall(firstIns);
@@ -535,8 +2416,9 @@ void InstrumentTrace(TRACE trace, VOID *v) {
                 IARG_REG_VALUE, tcReg,
                 IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
         INS_InsertThenCall(firstIns, IPOINT_BEFORE, (AFUNPTR)TraceGuard,
-                IARG_THREAD_ID, IARG_CONST_CONTEXT,
+                IARG_THREAD_ID, IARG_CONST_CONTEXT, IARG_RETURN_REGS, tcReg,
                 IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
+        InsertGuardResume(firstIns);
     }
 
     // Syscall guards
@@ -546,29 +2428,45 @@ void InstrumentTrace(TRACE trace, VOID *v) {
                 INS_InsertIfCall(ins, IPOINT_BEFORE, (AFUNPTR)RunSyscallGuard,
                         IARG_REG_VALUE, tcReg,
                         IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
-                INS_InsertThenCall(ins, IPOINT_BEFORE, (AFUNPTR)SyscallGuard,
-                        IARG_THREAD_ID, IARG_CONST_CONTEXT,
-                        IARG_CALL_ORDER, CALL_ORDER_FIRST, IARG_END);
+                InsertSyscallGuard(ins, (AFUNPTR)SyscallGuard);
             }
         }
     }
 
     TraceInfo pt;
     traceCallback(trace, pt);
+    if (spinCallback) InsertSpinSwitchCalls(trace, pt);
+    if (timeCallback) {
+        InsertVirtualRdtscCalls(trace);
+        if (!vdsoEntries.empty()) InsertVdsoSwitchCalls(trace, pt);
+    }
     Instrument(trace, pt);
 }
 
 /* Public interface */
 
+// Pin calls this from whichever thread triggered the flush, possibly while
+// the executor holds executorMutex and waits on Pin, so count atomically
+// instead of locking
+void CountCodeCacheFlush() {
+    __sync_fetch_and_add(&stats.codeCacheFlushes, 1);
+}
+
 void init(TraceCallback traceCb, ThreadCallback startCb, ThreadCallback endCb, CaptureCallback captureCb, UncaptureCallback uncaptureCb) {
-    for (auto& ts : threadStates) ts = UNCAPTURED;
-    for (auto& wl : waitLocks) wl.lock();
+    threadStates.reset(UNCAPTURED);
+    for (auto& ul : undoLogging) ul = false;
+    for (auto& kw : inKernelFutexWait) kw = false;
+    for (auto& sl : sleeping) sl = false;
+    for (auto& io : ioPending) io = false;
+    for (auto& sp : syscallPolicies) sp = SYSCALL_AUTO;
     curTid = -1u;
     executorTid = -1u;
     executorInSyscall = false;
+    executorKeptSyscall = false;
     delayedUncaptureAllowed = true;
     switchFlags = SF_NONE;
     capturedThreads = 0;
+    liveThreads = 0;
 
     traceCallback = traceCb;
     threadStartCallback = startCb;
@@ -579,10 +2477,13 @@ void init(TraceCallback traceCb, ThreadCallback startCb, ThreadCallback endCb, C
     tcReg = PIN_ClaimToolRegister();
     tidReg = PIN_ClaimToolRegister();
     switchReg = PIN_ClaimToolRegister();
+    undoReg = PIN_ClaimToolRegister();
 
     TRACE_AddInstrumentFunction(InstrumentTrace, 0);
+    CODECACHE_AddCacheFlushedFunction(CountCodeCacheFlush, 0);
     PIN_AddThreadStartFunction(ThreadStart, 0);
     PIN_AddThreadFiniFunction(ThreadFini, 0);
+    PIN_AddPrepareForFiniFunction(WatchdogFini, 0);
 }
 
 void setSyscallEnterCallback(SyscallEnterCallback syscallEnterCb) {
@@ -595,9 +2496,454 @@ void setSyscallExitCallback(SyscallExitCallback syscallExitCb) {
     syscallExitCallback = syscallExitCb;
 }
 
+void setSyscallEmulator(uint64_t nr, SyscallEmulator emulator) {
+    if (nr >= MAX_SYSCALLS) panic("setSyscallEmulator(): Syscall %ld too large (max %d)", nr, MAX_SYSCALLS);
+    syscallEmulators[nr] = emulator;
+}
+
+bool runSyscallOnExecutor(ThreadId tid, ThreadContext* tc) {
+    setReg(tc, REG_RAX, RunRawSyscall(tc));
+    return true;
+}
+
+/* Built-in syscall emulators */
+
+// Per-thread CPU clocks would give the executor's time
+bool EmulateClockSyscall(ThreadId tid, ThreadContext* tc) {
+    int64_t clockId = getReg(tc, REG_RDI);
+    if (clockId < 0 || clockId == CLOCK_THREAD_CPUTIME_ID) return false;
+    return runSyscallOnExecutor(tid, tc);
+}
+
+bool EmulateGetrusage(ThreadId tid, ThreadContext* tc) {
+    if ((int64_t)getReg(tc, REG_RDI) == RUSAGE_THREAD) return false;
+    return runSyscallOnExecutor(tid, tc);
+}
+
+// Only one guest thread runs at a time, so there is nobody to yield to
+bool EmulateSchedYield(ThreadId tid, ThreadContext* tc) {
+    setReg(tc, REG_RAX, 0);
+    return true;
+}
+
+void enableBuiltinSyscallEmulation() {
+    // These return process-wide state, so they can run from any thread. The
+    // executor runs them from analysis code, but on its guest thread's own
+    // physical thread; brk changes only the process's program break, which
+    // Pin's allocator (which uses mmap) does not use or track.
+    for (uint64_t nr : {SYS_getpid, SYS_getppid, SYS_getuid, SYS_geteuid,
+            SYS_getgid, SYS_getegid, SYS_getpgrp, SYS_getcwd, SYS_uname,
+            SYS_sysinfo, SYS_brk}) {
+        setSyscallEmulator(nr, runSyscallOnExecutor);
+    }
+    // Under virtual time, its emulators answer the clock syscalls, so they
+    // agree with the vDSO and RDTSC
+    if (!timeCallback) {
+        setSyscallEmulator(SYS_time, runSyscallOnExecutor);
+        setSyscallEmulator(SYS_gettimeofday, runSyscallOnExecutor);
+        setSyscallEmulator(SYS_clock_gettime, EmulateClockSyscall);
+    }
+    setSyscallEmulator(SYS_clock_getres, EmulateClockSyscall);
+    setSyscallEmulator(SYS_getrusage, EmulateGetrusage);
+    setSyscallEmulator(SYS_sched_yield, EmulateSchedYield);
+}
+
+void setExecutorCpus(const std::vector<uint32_t>& cpus) {
+    if (cpus.empty()) {
+        executorCpusSet = false;
+        return;
+    }
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0) {
+        panic("setExecutorCpus(): sched_getaffinity() failed: %s", strerror(errno));
+    }
+    CPU_ZERO(&executorCpus);
+    for (uint32_t cpu : cpus) {
+        if (cpu >= CPU_SETSIZE || !CPU_ISSET(cpu, &allowed)) {
+            panic("setExecutorCpus(): CPU %d is not in the process's affinity mask", cpu);
+        }
+        CPU_SET(cpu, &executorCpus);
+    }
+
+    // Others run anywhere else; if the executor CPUs are all there is, they
+    // must share them
+    CPU_XOR(&otherCpus, &allowed, &executorCpus);
+    if (CPU_COUNT(&otherCpus) == 0) otherCpus = allowed;
+
+    placements.fill(PLACE_ANY);
+    executorCpusSet = true;
+}
+
+void enableTraceEviction(uint32_t highWaterPct, uint32_t coldEpochsArg) {
+    if (highWaterPct == 0 || highWaterPct >= 100) panic("enableTraceEviction(): Invalid high-water mark %d%%", highWaterPct);
+    if (coldEpochsArg == 0) panic("enableTraceEviction(): coldEpochs must be positive");
+    evictionHighWaterPct = highWaterPct;
+    coldEpochs = coldEpochsArg;
+    if (!evictionEnabled) CODECACHE_AddCacheFlushedFunction(TraceEvictionFlushed, 0);
+    evictionEnabled = true;
+}
+
+Stats getStats() {
+    Stats snapshot = stats;
+    uint32_t numThreads = 0;
+    for (uint32_t tid = 0; tid < MAX_THREADS; tid++) {
+        const ThreadStats& ts = threadStats[tid];
+        if (ts.switchesIn || ts.captures || ts.syscalls) numThreads = tid + 1;
+    }
+    snapshot.threads.assign(threadStats.begin(), threadStats.begin() + numThreads);
+    return snapshot;
+}
+
+// Upper bound (TSC cycles) of the handoff latency bucket holding percentile pct
+uint64_t HandoffLatencyPercentile(const std::vector<uint64_t>& hist, uint64_t total, uint32_t pct) {
+    uint64_t seen = 0;
+    for (uint32_t i = 0; i < hist.size(); i++) {
+        seen += hist[i];
+        if (seen * 100 >= total * pct) return 2ul << i;
+    }
+    return -1ul;
+}
+
+void dumpStats() {
+    Stats s = getStats();
+    info("Stats: %ld switches, %ld captures, %ld uncaptures (%ld delayed)",
+            s.switches, s.captures, s.uncaptures, s.delayedUncaptures);
+    info(" syscalls: %ld (%ld shipped, %ld kept the executor)",
+            s.syscalls, s.shippedSyscalls, s.keptSyscalls);
+    info(" slow jumps: %ld, generic reg transfers: %ld reads, %ld writes",
+            s.slowJumps, s.genericRegReads, s.genericRegWrites);
+    info(" code cache: %ld flushes (%ld forced), %d KB used",
+            s.codeCacheFlushes, s.forcedFlushes, CODECACHE_CodeMemUsed() >> 10);
+    if (scheduleMode == SCHED_REPLAY) info(" replay: %ld locked switchpoints", s.replayLockedSwitchpoints);
+    std::vector<uint64_t> hist = getHandoffLatencies();
+    uint64_t wakeups = std::accumulate(hist.begin(), hist.end(), 0ul);
+    if (wakeups) {
+        info(" handoff wakeups: %ld, latency p50 < %ld, p90 < %ld, p99 < %ld cycles", wakeups,
+                HandoffLatencyPercentile(hist, wakeups, 50), HandoffLatencyPercentile(hist, wakeups, 90),
+                HandoffLatencyPercentile(hist, wakeups, 99));
+    }
+    for (uint32_t tid = 0; tid < s.threads.size(); tid++) {
+        const ThreadStats& ts = s.threads[tid];
+        if (!(ts.switchesIn || ts.captures || ts.syscalls)) continue;
+        info(" thread %d: %ld switches in, %ld captures, %ld uncaptures, %ld syscalls (%ld shipped)",
+                tid, ts.switchesIn, ts.captures, ts.uncaptures, ts.syscalls, ts.shippedSyscalls);
+    }
+}
+
+void enableCodePressurePolicy(CodePressureCallback cb, uint32_t compact, uint32_t coarse, uint64_t maxGrowthMBps) {
+    if (!compact || compact > coarse || coarse >= 100) {
+        panic("enableCodePressurePolicy(): Invalid thresholds %d%% / %d%%", compact, coarse);
+    }
+    pressureCallback = cb;
+    compactPct = compact;
+    coarsePct = coarse;
+    maxPinMemGrowth = maxGrowthMBps << 20;
+    pressurePolicyEnabled = true;
+}
+
+CodePressure getCodePressure() {
+    return codePressure;
+}
+
+TraceEvictionStats getTraceEvictionStats() {
+    scoped_mutex sm(evictionMutex);
+    return evictionStats;
+}
+
+ExecutorHandoffStats getExecutorHandoffStats() {
+    scoped_mutex sm(executorMutex);
+    return {executorHandoffs, executorCoreChanges};
+}
+
+void enableLockStats() {
+    executorMutex.lock();
+    executorLockStats = {};
+    executorMutex.trackStats(&executorLockStats);
+    executorLockTracked = true;
+    executorMutex.unlock();
+}
+
+LockStats getExecutorLockStats() {
+    executorMutex.lock();
+    LockStats st = {executorLockStats.acquires, executorLockStats.contended,
+                    executorLockStats.waitCycles};
+    executorMutex.unlock();
+    return st;
+}
+
+std::vector<uint64_t> getHandoffLatencies() {
+    return std::vector<uint64_t>(handoffLatencies.begin(), handoffLatencies.end());
+}
+
+void setSyscallPolicy(uint64_t nr, SyscallPolicy policy) {
+    if (nr >= MAX_SYSCALLS) panic("setSyscallPolicy(): Invalid syscall %ld", nr);
+    syscallPolicies[nr] = policy;
+}
+
+SyscallStats getSyscallStats(uint64_t nr) {
+    if (nr >= MAX_SYSCALLS) panic("getSyscallStats(): Invalid syscall %ld", nr);
+    executorMutex.lock();
+    SyscallStats st = syscallProfiles[nr].stats;
+    st.keepsExecutor = KeepsExecutor(nr);
+    executorMutex.unlock();
+    return st;
+}
+
+bool enableIoOffload(UncaptureCallback blockCb, CaptureCallback completeCb) {
+    assert(traceCallback);  // o/w not initialized
+    // Needs IORING_OP_READ/WRITE with the file position (offset -1)
+    if (!ioRing.init(IO_RING_ENTRIES, IORING_FEAT_RW_CUR_POS)) {
+        info("io_uring unavailable, not offloading I/O syscalls");
+        return false;
+    }
+    ioBlockCallback = blockCb;
+    ioCompleteCallback = completeCb;
+    if (PIN_SpawnInternalThread(IoCompletionThread, nullptr, 0, &ioThreadUid) == INVALID_THREADID) {
+        panic("Could not spawn I/O completion thread");
+    }
+    PIN_AddPrepareForFiniFunction(IoFini, 0);
+    ioOffload = true;
+    return true;
+}
+
+void setSpinCallback(SpinCallback spinCb, bool detectLoops) {
+    spinCallback = spinCb;
+    detectSpinLoops = detectLoops;
+}
+
+void enableVirtualTime(TimeCallback timeCb, uint64_t tscMHzArg, UncaptureCallback sleepCb, CaptureCallback wakeCb) {
+    assert(traceCallback);  // o/w not initialized
+    timeCallback = timeCb;
+    tscMHz = tscMHzArg;
+    sleepCallback = sleepCb;
+    sleepWakeCallback = wakeCb;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtimeBaseNs = ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+    for (uint64_t nr : {SYS_clock_gettime, SYS_gettimeofday, SYS_time}) {
+        setSyscallEmulator(nr, EmulateTimeSyscall);
+    }
+    IMG_AddInstrumentFunction(FindVdsoEntries, 0);
+}
+
+void enableIdling(IdleCallback idleCb) {
+    idlingEnabled = true;
+    idleCallback = idleCb;
+}
+
+void enableFutexEmulation(UncaptureCallback waitCb, CaptureCallback wakeCb) {
+    assert(traceCallback);  // o/w not initialized
+    futexWaitCallback = waitCb;
+    futexWakeCallback = wakeCb;
+    futexEmulation = true;
+}
+
+// Leave the domain, unlinking the segment if we were its last member. A
+// forked child runs a different program run, so it leaves the domain it
+// inherited; it may join again (e.g., from a fork callback) with another
+// procIdx, as sharing the parent's token id would let both hold the token.
+void LeaveDomain(bool inChild) {
+    if (!domain) return;
+    if (!inChild) {
+        uint64_t bit = 1ul << (domainTokenId - 1);
+        if (domain->token == domainTokenId) ReleaseDomainToken();
+        uint64_t members = __sync_and_and_fetch(&domain->members, ~bit);
+        if (!members) shm_unlink(domainName.c_str());
+    }
+    munmap(domain, sizeof(DomainState));
+    domain = nullptr;
+}
+
+void DomainFini(int, void*) {
+    LeaveDomain(false);
+}
+
+void DomainForkChild(THREADID, const CONTEXT*, void*) {
+    LeaveDomain(true);
+}
+
+// Maps the domain's segment and adds procIdx to its members
+void JoinDomain(const char* name, int32_t procIdx) {
+    // The segment starts zeroed, i.e., with a free token
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0600);
+    if (fd < 0) panic("joinDomain(): shm_open(%s) failed", name);
+    if (ftruncate(fd, sizeof(DomainState)) != 0) panic("joinDomain(): ftruncate(%s) failed", name);
+    void* seg = mmap(nullptr, sizeof(DomainState), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (seg == MAP_FAILED) panic("joinDomain(): mmap(%s) failed", name);
+    close(fd);
+
+    domain = (DomainState*)seg;
+    domainName = name;
+    if (procIdx < 0) {
+        // Take the lowest free index; exited members free theirs
+        uint64_t members = domain->members;
+        while (true) {
+            if (~members == 0) panic("joinDomain(): Domain %s is full (%d processes)", name, MAX_DOMAIN_PROCS);
+            uint64_t bit = ~members & (members + 1);
+            uint64_t prev = __sync_val_compare_and_swap(&domain->members, members, members | bit);
+            if (prev == members) {
+                procIdx = __builtin_ctzl(bit);
+                break;
+            }
+            members = prev;
+        }
+    } else {
+        uint64_t bit = 1ul << procIdx;
+        if (__sync_fetch_and_or(&domain->members, bit) & bit) panic("joinDomain(): procIdx %d already in domain %s", procIdx, name);
+    }
+    domainTokenId = procIdx + 1;
+
+    static bool hooksAdded = false;  // rejoining (e.g., in a forked child) must not add them again
+    if (!hooksAdded) {
+        PIN_AddFiniFunction(DomainFini, 0);
+        PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, DomainForkChild, 0);
+        hooksAdded = true;
+    }
+    DEBUG("Joined domain %s as process %d", name, procIdx);
+}
+
+void joinDomain(const char* name, uint32_t procIdx) {
+    assert(traceCallback);  // o/w not initialized
+    if (domain) panic("joinDomain(): Process already in a domain");
+    if (procIdx >= MAX_DOMAIN_PROCS) panic("joinDomain(): procIdx %d too large (max %d)", procIdx, MAX_DOMAIN_PROCS);
+    JoinDomain(name, procIdx);
+}
+
+uint32_t joinDomain(const char* name) {
+    assert(traceCallback);  // o/w not initialized
+    if (domain) panic("joinDomain(): Process already in a domain");
+    JoinDomain(name, -1);
+    return domainTokenId - 1;
+}
+
+bool domainHandoff(uint32_t procIdx) {
+    assert(domain);
+    assert(procIdx < MAX_DOMAIN_PROCS);
+    assert(domain->token == domainTokenId);
+    if (procIdx + 1 == domainTokenId) return true;
+    // Only a process waiting for the token can use it and pass it back. A
+    // waiter stays waiting until the token reaches it, as we hold it now.
+    if (!(domain->waiters & (1ul << procIdx))) return false;
+    futex_token_pass(&domain->token, procIdx + 1);
+    AcquireDomainToken();
+    return true;
+}
+
+// Reap one child of the fork server; returns false if it failed
+bool WaitForForkChild() {
+    // NOTE: Raw wait4, as sys/wait.h drags in ucontext's REG_* names, which
+    // clash with Pin's
+    int status;
+    long pid = syscall(SYS_wait4, -1, &status, 0, NULL);
+    if (pid < 0) panic("forkServer(): wait4() failed");
+    bool ok = (status == 0);  // exited normally with code 0
+    if (!ok) info("forkServer(): child %ld failed (status %d)", pid, status);
+    return ok;
+}
+
+bool forkServer(uint32_t nchildren, uint32_t maxConcurrent, ForkCallback postForkCb) {
+    assert(maxConcurrent > 0);
+    executorMutex.lock();
+
+    // Every live thread must be captured (though it may be blocked), so that
+    // no thread is inside a syscall that the children would lose
+    uint32_t inProgram = MAX_THREADS - threadStates.count(UNCAPTURED);
+    if (inProgram != liveThreads || executorInSyscall || ioInFlight) {
+        DEBUG("forkServer(): not quiescent (%d/%d threads captured)", inProgram, liveThreads);
+        executorMutex.unlock();
+        return false;
+    }
+
+    if (schedWriter) schedWriter->flush();  // or children would write it again
+
+    // Fork without executorMutex held, so the parent's other internal threads
+    // (e.g., the syscall watchdog) can keep taking it. Guest threads can't
+    // run meanwhile, as we're the executor and all of them are captured.
+    executorMutex.unlock();
+    uint32_t running = 0;
+    bool ok = true;
+    for (uint32_t c = 0; c < nchildren; c++) {
+        if (running == maxConcurrent) {
+            ok &= WaitForForkChild();
+            running--;
+        }
+        pid_t pid = fork();
+        if (pid < 0) panic("forkServer(): fork() failed");
+        if (pid == 0) {
+            // Only we survive, so locks held by other threads at the fork
+            // must be reset. Reconstruct them in place, as MCS locks embed
+            // their (large) node arrays.
+            new (&executorMutex) aligned_spin_mutex();
+            if (executorLockTracked) executorMutex.trackStats(&executorLockStats);
+            new (&logMutex) spin_mutex();
+            executorMutex.lock();
+
+            // Other threads are now contexts that the executor runs, so their
+            // wakeups are meaningless, and the child is a separate run that
+            // must not share the parent's domain.
+            inForkChild = true;
+            for (auto& ps : parkingSlots) ps.reset();
+            if (scheduleMode == SCHED_RECORD) scheduleMode = SCHED_NONE;
+            ioOffload = false;  // the completion thread is gone
+            watchdogSpawned = false;  // ditto
+            captureQueue = CQ_CLOSED;  // no other physical threads to queue
+            LeaveDomain(true);
+            // Futex waits block like uncaptures unless the tool handles them
+            if (!futexEmulation) {
+                futexWaitCallback = uncaptureCallback;
+                futexWakeCallback = captureCallback;
+            }
+            executorMutex.unlock();
+            postForkCb(c);
+            return true;
+        }
+        running++;
+    }
+    while (running--) ok &= WaitForForkChild();
+
+    // The server has done its job; its own threads never run again. Exit
+    // through Pin's normal path, so fini functions (e.g., stats) run.
+    PIN_ExitApplication(ok? 0 : 1);
+    return false;  // unreachable
+}
+
+void recordSchedule(const char* file) {
+    assert(traceCallback);  // o/w not initialized
+    if (scheduleMode != SCHED_NONE) panic("recordSchedule(): Already recording or replaying a schedule");
+    schedWriter = new ScheduleWriter(file);
+    scheduleMode = SCHED_RECORD;
+    PIN_AddFiniFunction(ScheduleFini, 0);
+}
+
+void replaySchedule(const char* file) {
+    assert(traceCallback);  // o/w not initialized
+    if (scheduleMode != SCHED_NONE) panic("replaySchedule(): Already recording or replaying a schedule");
+    schedEvents = ReadSchedule(file);
+    scheduleMode = SCHED_REPLAY;
+    info("Replaying schedule %s (%ld events)", file, schedEvents.size());
+}
+
+// Slow mode saves the running thread's context only for switchcalls that
+// take it, so others can't use it. Callbacks that run after such a
+// switchcall, during a switch that does not jump, save it on demand.
+void CheckContextSaved(ThreadId tid) {
+#ifdef SPIN_SLOW
+    if (pendingContext && tid == curTid) {
+        InitContext(pendingContext, GetTC(tid));
+        pendingContext = nullptr;
+    }
+    if (unsavedSwitchcall && tid == curTid) {
+        panic("Switchcall used the context of running thread %d without taking IARG_SPIN_CONTEXT. "
+                "Unsupported in slow mode!", tid);
+    }
+#endif
+}
+
 ThreadContext* getContext(ThreadId tid) {
     assert(tid < MAX_THREADS);
     assert(threadStates[tid] != UNCAPTURED);
+    CheckContextSaved(tid);
     return GetTC(tid);
 }
 
@@ -617,35 +2963,210 @@ REG __getTidReg() {
 }
 
 void blockAfterSwitch() {
+    if (scheduleMode == SCHED_REPLAY) return;  // the schedule blocks threads
     assert(!(switchFlags & SF_BLOCK));
     switchFlags |= SF_BLOCK;  // honored by RecordSwitch
 }
 
 void blockIdleThread(ThreadId tid) {
+    if (scheduleMode == SCHED_REPLAY) return;
     if (!inUncaptureCallback) executorMutex.lock();
-    assert(tid < MAX_THREADS);
-    assert(threadStates[tid] == IDLE);
-    assert(capturedThreads > 1);
-    threadStates[tid] = BLOCKED;
-    capturedThreads--;
+    BlockIdle(tid);
     if (!inUncaptureCallback) executorMutex.unlock();
 }
 
 void unblock(ThreadId tid) {
+    if (scheduleMode == SCHED_REPLAY) return;
+    if (!inUncaptureCallback) executorMutex.lock();
+    Unblock(tid);
+    if (!inUncaptureCallback) executorMutex.unlock();
+}
+
+void blockUntil(ThreadId tid, uint64_t time) {
+    if (scheduleMode == SCHED_REPLAY) return;
     if (!inUncaptureCallback) executorMutex.lock();
+    if (time > timerWheel.time()) {
+        if (tid == curTid) {
+            // From the running thread's switchcall, like blockAfterSwitch()
+            assert(!(switchFlags & SF_BLOCK));
+            switchFlags |= SF_BLOCK;
+        } else {
+            BlockIdle(tid);
+        }
+        timerWheel.arm(tid, time);
+    }
+    if (!inUncaptureCallback) executorMutex.unlock();
+}
+
+void advanceClock(uint64_t time) {
+    if (!inUncaptureCallback) executorMutex.lock();
+    timerWheel.advance(time, [](uint32_t tid) {
+        DEBUG("Timer of thread %d expired at %ld", tid, timerWheel.time());
+        // Tell the tool about sleepers it did not block itself (unless they
+        // had not switched out yet)
+        bool wakesSleeper = sleeping[tid] && threadStates[tid] == BLOCKED;
+        Unblock(tid);
+        if (wakesSleeper) {
+            bool nested = inUncaptureCallback;
+            inUncaptureCallback = true;  // like uncaptureCallback, may (un)block threads
+            sleepWakeCallback(tid, false);
+            inUncaptureCallback = nested;
+        }
+    });
+    if (!inUncaptureCallback) executorMutex.unlock();
+}
+
+uint64_t getClock() {
+    return timerWheel.time();
+}
+
+bool getNextDeadline(uint64_t* time) {
+    if (!inUncaptureCallback) executorMutex.lock();
+    bool armed = timerWheel.nextDeadline(time);
+    if (!inUncaptureCallback) executorMutex.unlock();
+    return armed;
+}
+
+ThreadId firstIdle() {
+    return threadStates.first(IDLE);
+}
+
+ThreadId nextIdleAfter(ThreadId tid) {
     assert(tid < MAX_THREADS);
-    if (threadStates[tid] == BLOCKED) {
-        threadStates[tid] = IDLE;
-        capturedThreads++;
-    } else {
-        // An unblock fired right after a call to blockAfterSwitch. This makes
-        // blockAfterSwitch look functionally equivalent to being blocked
-        // TODO: Simplify interface: block() and unblock() for arbitrary threads!
-        assert(switchFlags & SF_BLOCK);
-        assert(threadStates[tid] == RUNNING);
-        switchFlags &= ~SF_BLOCK;
+    return threadStates.nextAfter(IDLE, tid);
+}
+
+uint32_t countIdle() {
+    return threadStates.count(IDLE);
+}
+
+uint64_t getIdleMask(uint32_t word) {
+    assert(word < MAX_THREADS / 64);
+    return threadStates.word(IDLE, word);
+}
+
+uint32_t unblockMask(uint32_t word, uint64_t mask) {
+    if (scheduleMode == SCHED_REPLAY) return 0;
+    assert(word < MAX_THREADS / 64);
+    if (!inUncaptureCallback) executorMutex.lock();
+    // Blocked threads, plus the running one if it called blockAfterSwitch()
+    uint64_t blocked = threadStates.word(BLOCKED, word);
+    if ((switchFlags & SF_BLOCK) && curTid / 64 == word) blocked |= 1ul << (curTid % 64);
+    uint64_t toUnblock = mask & blocked;
+    uint32_t n = 0;
+    while (toUnblock) {
+        n += Unblock(word * 64 + __builtin_ctzl(toUnblock));
+        toUnblock &= toUnblock - 1;
+    }
+    if (!inUncaptureCallback) executorMutex.unlock();
+    return n;
+}
+
+void enableVirtualCores(uint32_t numCores, StealPolicy steal, uint32_t minLength) {
+    if (!numCores || numCores > MAX_THREADS) panic("enableVirtualCores(): Invalid number of cores %d", numCores);
+    if (!inUncaptureCallback) executorMutex.lock();
+    runQueues.resize(numCores);
+    stealPolicy = steal;
+    minStealLength = std::max(minLength, 1u);
+    for (ThreadId tid = threadStates.first(IDLE); tid != -1u; tid = threadStates.nextAfter(IDLE, tid)) {
+        runQueues.push(tid);
+    }
+    if (!inUncaptureCallback) executorMutex.unlock();
+}
+
+// Core to steal from for thief, or -1 if none qualifies
+uint32_t StealVictim(uint32_t thief) {
+    uint32_t numCores = runQueues.size();
+    uint32_t victim = -1u;
+    for (uint32_t i = 1; i < numCores; i++) {
+        uint32_t core = (thief + i) % numCores;
+        uint32_t len = runQueues.length(core);
+        if (len < minStealLength) continue;
+        if (stealPolicy == STEAL_NEXT) return core;
+        if (victim == -1u || len > runQueues.length(victim)) victim = core;
+    }
+    return victim;
+}
+
+ThreadId nextOnCore(uint32_t core) {
+    if (!inUncaptureCallback) executorMutex.lock();
+    assert(core < runQueues.size());
+    ThreadId tid = runQueues.front(core);
+    if (tid == RunQueues::NONE && stealPolicy != STEAL_NONE) {
+        uint32_t victim = StealVictim(core);
+        if (victim != -1u) {
+            tid = runQueues.back(victim);
+            runQueues.setHome(tid, core);
+            steals++;
+            DEBUG("Core %d stole thread %d from core %d", core, tid, victim);
+        }
     }
     if (!inUncaptureCallback) executorMutex.unlock();
+    return tid;
+}
+
+void setThreadCore(ThreadId tid, uint32_t core) {
+    assert(tid < MAX_THREADS);
+    if (!inUncaptureCallback) executorMutex.lock();
+    assert(core < runQueues.size());
+    runQueues.setHome(tid, core);
+    if (!inUncaptureCallback) executorMutex.unlock();
+}
+
+uint32_t getThreadCore(ThreadId tid) {
+    assert(tid < MAX_THREADS);
+    if (!inUncaptureCallback) executorMutex.lock();
+    assert(runQueues.size());
+    uint32_t core = runQueues.home(tid);  // may assign tid's home
+    if (!inUncaptureCallback) executorMutex.unlock();
+    return core;
+}
+
+uint32_t getCoreQueueLength(uint32_t core) {
+    if (!inUncaptureCallback) executorMutex.lock();
+    assert(core < runQueues.size());
+    uint32_t len = runQueues.length(core);
+    if (!inUncaptureCallback) executorMutex.unlock();
+    return len;
+}
+
+uint64_t getSteals() {
+    return steals;
+}
+
+void checkpoint(ThreadId tid) {
+    assert(tid < MAX_THREADS);
+    assert(threadStates[tid] != UNCAPTURED);
+    assert(!undoLogging[tid]);
+    CheckContextSaved(tid);
+    SaveCheckpoint(GetTC(tid), &checkpoints[tid]);
+    undoLogs[tid].clear();
+    undoLogging[tid] = true;
+    NotifySetUndoMode(tid);
+}
+
+void commit(ThreadId tid) {
+    assert(tid < MAX_THREADS);
+    assert(undoLogging[tid]);
+    undoLogs[tid].clear();
+    undoLogging[tid] = false;
+    NotifySetUndoMode(tid);
+}
+
+void rollback(ThreadId tid) {
+    assert(tid < MAX_THREADS);
+    assert(undoLogging[tid]);
+    CheckContextSaved(tid);
+    DEBUG("Rolling back thread %d (%ld writes)", tid, undoLogs[tid].size());
+    undoLogs[tid].rollback();
+    undoLogging[tid] = false;
+    RestoreCheckpoint(GetTC(tid), &checkpoints[tid]);
+    NotifySetPC(tid);  // restored PC; also stops undo logging when we jump
+}
+
+bool isSpeculative(ThreadId tid) {
+    assert(tid < MAX_THREADS);
+    return undoLogging[tid];
 }
 
 void loop() {
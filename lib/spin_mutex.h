@@ -0,0 +1,57 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SPIN_MUTEX_H_
+#define SPIN_MUTEX_H_
+
+#include "mutex.h"
+
+/* Lock used for libspin's internal mutexes (executorMutex, logMutex, and
+ * evictionMutex), chosen at build time with scons --libspinLock (see
+ * lib/SConscript). The futex mutex is cheapest uncontended but unfair; the
+ * ticket and MCS locks hand the lock over in FIFO order, and MCS waiters
+ * spin on their own node; the adaptive lock bounds spinning by how long
+ * recent contended acquisitions took. Only libspin's sources may include
+ * this, as tools are not built with the same defines.
+ */
+
+// MCS queue nodes: one per Pin thread (see spin::MAX_THREADS), plus
+// one shared by threads Pin does not know yet (i.e., main before
+// PIN_StartProgram()). SpinMutexNodeId() picks the calling thread's.
+#define SPIN_MUTEX_NODES (2048 + 1)
+uint32_t SpinMutexNodeId();
+
+#if defined(SPIN_LOCK_TICKET)
+typedef ticket_mutex spin_mutex;
+#elif defined(SPIN_LOCK_ADAPTIVE)
+typedef adaptive_mutex spin_mutex;
+#elif defined(SPIN_LOCK_MCS)
+typedef mcs_mutex<SPIN_MUTEX_NODES, SpinMutexNodeId> spin_mutex;
+#else
+typedef tracked_mutex spin_mutex;
+#endif
+
+class aligned_spin_mutex : public spin_mutex {} ATTR_LINE_ALIGNED;
+
+#endif  // SPIN_MUTEX_H_
@@ -0,0 +1,110 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef STATE_BITMAPS_H_
+#define STATE_BITMAPS_H_
+
+/* Per-id states that also keep one bitmap per state, so finding, iterating,
+ * and counting the ids in a given state take a few bit operations instead of
+ * a scan. Each state also has a summary word that marks its non-empty bitmap
+ * words, so lookups are O(1) for up to 64*64 ids. Reads use operator[];
+ * writes must use set(), which keeps the bitmaps in sync.
+ */
+
+#include <array>
+#include <stdint.h>
+
+template <typename State, uint32_t NumStates, uint32_t MaxIds>
+class StateBitmaps {
+    private:
+        static_assert(MaxIds % 64 == 0 && MaxIds <= 64 * 64, "Unsupported number of ids");
+        static const uint32_t WORDS = MaxIds / 64;
+
+        std::array<State, MaxIds> states;
+        uint64_t bits[NumStates][WORDS];
+        uint64_t summary[NumStates];  // bit w set if bits[s][w] != 0
+        uint32_t counts[NumStates];
+
+        // First id in state s at or after word w, masked by mask
+        uint32_t findFrom(State s, uint32_t w, uint64_t mask) const {
+            uint64_t word = bits[s][w] & mask;
+            if (word) return w * 64 + __builtin_ctzl(word);
+            if (w + 1 >= WORDS) return -1u;
+            uint64_t later = summary[s] & (~0ul << (w + 1));
+            if (!later) return -1u;
+            uint32_t nw = __builtin_ctzl(later);
+            return nw * 64 + __builtin_ctzl(bits[s][nw]);
+        }
+
+    public:
+        explicit StateBitmaps(State initial) { reset(initial); }
+
+        // Sets all ids to state s
+        void reset(State s) {
+            states.fill(s);
+            for (uint32_t i = 0; i < NumStates; i++) {
+                for (uint32_t w = 0; w < WORDS; w++) bits[i][w] = (i == (uint32_t)s)? ~0ul : 0;
+                summary[i] = (i == (uint32_t)s)? (~0ul >> (64 - WORDS)) : 0;
+                counts[i] = (i == (uint32_t)s)? MaxIds : 0;
+            }
+        }
+
+        State operator[](uint32_t id) const { return states[id]; }
+
+        void set(uint32_t id, State s) {
+            State old = states[id];
+            if (old == s) return;
+            states[id] = s;
+            uint32_t w = id / 64;
+            uint64_t bit = 1ul << (id % 64);
+            bits[old][w] &= ~bit;
+            if (!bits[old][w]) summary[old] &= ~(1ul << w);
+            counts[old]--;
+            bits[s][w] |= bit;
+            summary[s] |= 1ul << w;
+            counts[s]++;
+        }
+
+        // Lowest id in state s, or -1u if none
+        uint32_t first(State s) const {
+            if (!summary[s]) return -1u;
+            uint32_t w = __builtin_ctzl(summary[s]);
+            return w * 64 + __builtin_ctzl(bits[s][w]);
+        }
+
+        // Lowest id above id in state s, or -1u if none
+        uint32_t nextAfter(State s, uint32_t id) const {
+            if (id + 1 >= MaxIds) return -1u;
+            uint32_t n = id + 1;
+            return findFrom(s, n / 64, ~0ul << (n % 64));
+        }
+
+        uint32_t count(State s) const { return counts[s]; }
+
+        // Ids 64*w to 64*w+63 in state s, as a bitmask
+        uint64_t word(State s, uint32_t w) const { return bits[s][w]; }
+};
+
+#endif  // STATE_BITMAPS_H_
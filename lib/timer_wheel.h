@@ -0,0 +1,156 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#ifndef TIMER_WHEEL_H_
+#define TIMER_WHEEL_H_
+
+/* Hierarchical timer wheel of per-id deadlines on a clock that only moves
+ * forward when advanced. Level l has 64 slots of 64^l ticks each, and a timer
+ * sits at the level of the highest base-64 digit where its deadline differs
+ * from the current time, so lower levels always expire first. Advancing jumps
+ * straight to the next non-empty slot (found through per-level bitmaps) and
+ * either expires its timers or cascades them to lower levels, so the cost is
+ * O(expired + cascades), and each timer cascades at most once per level.
+ * Ids are small integers (thread ids), so lists are intrusive, over per-id
+ * arrays, and arming and cancelling are O(1).
+ */
+
+#include <algorithm>
+#include <stdint.h>
+#include <vector>
+
+class TimerWheel {
+    private:
+        static const uint32_t SLOT_BITS = 6;
+        static const uint32_t SLOTS = 1 << SLOT_BITS;
+        static const uint32_t LEVELS = (64 + SLOT_BITS - 1) / SLOT_BITS;
+        static const uint32_t NONE = -1u;
+
+        std::vector<uint32_t> heads;  // LEVELS * SLOTS lists
+        uint64_t occupied[LEVELS];  // bitmaps of non-empty slots
+        std::vector<uint32_t> next;
+        std::vector<uint32_t> prev;
+        std::vector<uint32_t> slots;  // slot of each id, or NONE if not armed
+        std::vector<uint64_t> deadlines;
+        uint64_t now;
+
+        void insert(uint32_t id) {
+            uint64_t diff = deadlines[id] ^ now;
+            uint32_t level = (63 - __builtin_clzl(diff)) / SLOT_BITS;
+            uint32_t slot = level * SLOTS + ((deadlines[id] >> (level * SLOT_BITS)) & (SLOTS - 1));
+            next[id] = heads[slot];
+            prev[id] = NONE;
+            if (heads[slot] != NONE) prev[heads[slot]] = id;
+            heads[slot] = id;
+            occupied[level] |= 1ul << (slot % SLOTS);
+            slots[id] = slot;
+        }
+
+        void unlink(uint32_t id) {
+            uint32_t slot = slots[id];
+            if (prev[id] != NONE) next[prev[id]] = next[id];
+            else heads[slot] = next[id];
+            if (next[id] != NONE) prev[next[id]] = prev[id];
+            if (heads[slot] == NONE) occupied[slot / SLOTS] &= ~(1ul << (slot % SLOTS));
+            slots[id] = NONE;
+        }
+
+        // Lowest non-empty slot, or NONE
+        uint32_t firstSlot() const {
+            for (uint32_t level = 0; level < LEVELS; level++) {
+                if (occupied[level]) return level * SLOTS + __builtin_ctzl(occupied[level]);
+            }
+            return NONE;
+        }
+
+    public:
+        // +NONE passes a copy: vectors take values by reference, and binding
+        // one to NONE would need an out-of-class definition at -O0
+        explicit TimerWheel(uint32_t maxIds)
+            : heads(LEVELS * SLOTS, +NONE), next(maxIds), prev(maxIds),
+              slots(maxIds, +NONE), deadlines(maxIds), now(0)
+        {
+            for (uint32_t level = 0; level < LEVELS; level++) occupied[level] = 0;
+        }
+
+        uint64_t time() const { return now; }
+        bool armed(uint32_t id) const { return slots[id] != NONE; }
+
+        // Returns false, without arming, if the deadline is not in the future
+        bool arm(uint32_t id, uint64_t deadline) {
+            if (armed(id)) unlink(id);
+            if (deadline <= now) return false;
+            deadlines[id] = deadline;
+            insert(id);
+            return true;
+        }
+
+        // Returns whether id was armed
+        bool cancel(uint32_t id) {
+            if (!armed(id)) return false;
+            unlink(id);
+            return true;
+        }
+
+        // Earliest deadline, if any timer is armed. Scans one slot.
+        bool nextDeadline(uint64_t* deadline) const {
+            uint32_t slot = firstSlot();
+            if (slot == NONE) return false;
+            uint64_t d = -1ul;
+            for (uint32_t id = heads[slot]; id != NONE; id = next[id]) d = std::min(d, deadlines[id]);
+            *deadline = d;
+            return true;
+        }
+
+        // Moves the clock to target (if later) and calls expire(id) on each
+        // timer with deadline <= target, in deadline order.
+        // Timers are disarmed before their expire call.
+        template <typename F> void advance(uint64_t target, F expire) {
+            while (true) {
+                uint32_t slot = firstSlot();
+                if (slot == NONE) break;
+                uint32_t level = slot / SLOTS;
+                uint32_t shift = level * SLOT_BITS;
+                // Slot start: now's digits above the level, the slot's digit
+                // at the level, and zeroes below
+                uint64_t above = (shift + SLOT_BITS >= 64)? 0 : (now >> (shift + SLOT_BITS)) << (shift + SLOT_BITS);
+                uint64_t start = above | ((uint64_t)(slot % SLOTS) << shift);
+                if (start > target) break;
+
+                now = start;
+                uint32_t id = heads[slot];
+                while (id != NONE) {
+                    uint32_t nextId = next[id];
+                    unlink(id);
+                    if (deadlines[id] == now) expire(id);
+                    else insert(id);  // to a lower level
+                    id = nextId;
+                }
+            }
+            if (target > now) now = target;
+        }
+};
+
+#endif  // TIMER_WHEEL_H_
@@ -0,0 +1,71 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef UNDO_LOG_H_
+#define UNDO_LOG_H_
+
+/* Log of a thread's memory writes, used to roll back speculative threads */
+
+#include <stdint.h>
+#include <vector>
+
+#include "pin/pin.H"
+
+class UndoLog {
+    private:
+        struct Entry {
+            ADDRINT addr;
+            uint64_t size;
+            uint64_t offset;  // into oldData
+        };
+        std::vector<Entry> entries;
+        std::vector<uint8_t> oldData;
+
+    public:
+        // Save the contents of [addr, addr+size) before they are overwritten
+        void record(ADDRINT addr, uint32_t size) {
+            uint64_t offset = oldData.size();
+            oldData.resize(offset + size);
+            // If the write faults, only the readable prefix will be written
+            size_t copied = PIN_SafeCopy(&oldData[offset], (const void*)addr, size);
+            entries.push_back({addr, copied, offset});
+        }
+
+        // Restore all logged writes, most recent first, and clear the log
+        void rollback() {
+            for (auto it = entries.rbegin(); it != entries.rend(); it++) {
+                PIN_SafeCopy((void*)it->addr, &oldData[it->offset], it->size);
+            }
+            clear();
+        }
+
+        void clear() {
+            entries.clear();
+            oldData.clear();
+        }
+
+        size_t size() const { return entries.size(); }
+};
+
+#endif  // UNDO_LOG_H_
@@ -0,0 +1,79 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+// Threads pass a token around a ring through a mutex and a condition
+// variable, so almost every step blocks and wakes threads through futexes
+// (e.g., run it under the interleaver with -futexEmulation).
+
+uint32_t nthreads;
+uint64_t iters;
+pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+uint32_t turn = 0;
+uint64_t counter = 0;
+
+void* worker(void* arg) {
+    uint32_t id = (uintptr_t)arg;
+    for (uint64_t i = 0; i < iters; i++) {
+        pthread_mutex_lock(&mutex);
+        while (turn != id) pthread_cond_wait(&cond, &mutex);
+        counter++;
+        turn = (turn + 1) % nthreads;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+    return nullptr;
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s <nthreads> <iters>\n", argv[0]);
+        return -1;
+    }
+    nthreads = atoi(argv[1]);
+    iters = atoi(argv[2]);
+    assert(nthreads > 0);
+    printf("Running with %d threads, %ld iters\n", nthreads, iters);
+
+    pthread_t th[nthreads];
+    for (uint32_t i = 1; i < nthreads; i++) {
+        pthread_create(&th[i], nullptr, worker, (void*)(uintptr_t)i);
+    }
+    worker((void*)0);
+    for (uint32_t i = 1; i < nthreads; i++) {
+        pthread_join(th[i], nullptr);
+    }
+
+    bool verify = counter == (iters * nthreads);
+    printf("Verify: %s\n", verify ? "OK" : "Incorrect");
+    if (!verify) return -1;
+    else return 0;
+}
@@ -0,0 +1,74 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// Client/server pair of processes that bounce a counter through pipes. Each
+// process runs its own libspin instance; use it to exercise executor domains
+// (e.g., run it under the interleaver with -domain).
+
+int main(int argc, const char* argv[]) {
+    if (argc != 2) {
+        printf("Usage: %s <iters>\n", argv[0]);
+        return -1;
+    }
+    uint64_t iters = atoi(argv[1]);
+    printf("Running with %ld iters\n", iters);
+    fflush(stdout);  // do not duplicate buffered output on fork
+
+    int toServer[2], toClient[2];
+    if (pipe(toServer) || pipe(toClient)) return -1;
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        // Server: increment and send back
+        uint64_t v;
+        for (uint64_t i = 0; i < iters; i++) {
+            if (read(toServer[0], &v, sizeof(v)) != sizeof(v)) return -1;
+            v++;
+            if (write(toClient[1], &v, sizeof(v)) != sizeof(v)) return -1;
+        }
+        return 0;
+    }
+
+    // Client
+    uint64_t v = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        if (write(toServer[1], &v, sizeof(v)) != sizeof(v)) return -1;
+        if (read(toClient[0], &v, sizeof(v)) != sizeof(v)) return -1;
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    printf("v: %ld\n", v);
+    bool verify = v == iters && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    printf("Verify: %s\n", verify ? "OK" : "Incorrect");
+    if (!verify) return -1;
+    else return 0;
+}
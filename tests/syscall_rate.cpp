@@ -0,0 +1,81 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+// Threads that run cheap syscalls back to back. Reports syscalls per second,
+// which is dominated by the capture/uncapture paths when run under libspin.
+// Under the interleaver, its stats also report the handoff latencies.
+
+uint64_t iters;
+volatile uint64_t total;
+
+void* worker(void* arg) {
+    uint64_t pid = getpid();
+    uint64_t ok = 0;
+    for (uint64_t i = 0; i < iters; i++) {
+        // Raw syscall; libc may cache getpid()
+        ok += ((uint64_t)syscall(SYS_getpid) == pid);
+    }
+    __sync_fetch_and_add(&total, ok);
+    return nullptr;
+}
+
+int main(int argc, const char* argv[]) {
+    if (argc != 3) {
+        printf("Usage: %s <nthreads> <iters>\n", argv[0]);
+        return -1;
+    }
+    uint32_t nthreads = atoi(argv[1]);
+    iters = atoi(argv[2]);
+    assert(nthreads > 0);
+    printf("Running with %d threads, %ld iters\n", nthreads, iters);
+
+    struct timeval start, end;
+    gettimeofday(&start, nullptr);
+    pthread_t th[nthreads];
+    for (uint32_t i = 1; i < nthreads; i++) {
+        pthread_create(&th[i], nullptr, worker, nullptr);
+    }
+    worker(nullptr);
+    for (uint32_t i = 1; i < nthreads; i++) {
+        pthread_join(th[i], nullptr);
+    }
+    gettimeofday(&end, nullptr);
+
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) * 1e-6;
+    printf("Syscalls/s: %.0f\n", (nthreads * iters) / secs);
+    bool verify = total == (iters * nthreads);
+    printf("Verify: %s\n", verify ? "OK" : "Incorrect");
+    if (!verify) return -1;
+    else return 0;
+}
@@ -26,12 +26,22 @@
 #include <deque>
 #include <stdio.h>
 #include <stdint.h>
+#include <string>
 
 #include "spin.h"
 
 // Use libspin's mutex... hacky
 #include "../lib/mutex.h"
 
+KNOB<bool> KnobSpinYield(KNOB_MODE_WRITEONCE, "pintool", "spinYield", "0",
+        "switch threads at detected spin-waits (PAUSEs and load-compare loops)");
+KNOB<bool> KnobFutexEmulation(KNOB_MODE_WRITEONCE, "pintool", "futexEmulation", "0",
+        "emulate futexes, blocking waiters instead of uncapturing them");
+KNOB<bool> KnobCodePressure(KNOB_MODE_WRITEONCE, "pintool", "codePressure", "0",
+        "coarsen switchpoints to trace heads under code cache pressure");
+KNOB<std::string> KnobDomain(KNOB_MODE_WRITEONCE, "pintool", "domain", "",
+        "join this executor domain (shm name); forked children join too");
+
 /* Logging */
 
 static mutex toolLogMutex;
@@ -68,6 +78,7 @@ void fini(int tid, void* dummy) {
     fprintf(stderr, " switches: %ld\n", switchCount);
     fprintf(stderr, " code cache size: %d bytes\n", CODECACHE_CodeMemUsed());
     fflush(stderr);
+    spin::dumpStats();
 }
 
 // Used to round-robin through threads
@@ -88,6 +99,21 @@ uint32_t uncapture(spin::ThreadId tid, spin::ThreadContext* tc) {
     return next;
 }
 
+// Emulated futex waits block the running thread, so move on to the next one
+uint32_t futexWait(spin::ThreadId tid, spin::ThreadContext* tc) {
+    scoped_mutex sm(queueMutex);
+    assert(!threadQueue.empty());  // spin does not block the last thread
+    uint32_t next = threadQueue.front();
+    threadQueue.pop_front();
+    switchCount++;
+    return next;
+}
+
+void futexWake(spin::ThreadId tid, bool runsNext) {
+    scoped_mutex sm(queueMutex);
+    threadQueue.push_back(tid);
+}
+
 void capture(spin::ThreadId tid, bool runsNext) {
     info("Capturing tid %d", tid);
     if (!runsNext) {
@@ -141,12 +167,33 @@ uint64_t countInstrsAndSwitch(spin::ThreadId curTid, const spin::ThreadContext*
     return nextTid;
 }
 
+// Spin-waits can't make progress until some other thread runs, so yield
+spin::ThreadId spinYield(spin::ThreadId curTid, uint64_t pc) {
+    scoped_mutex sm(queueMutex);
+    threadQueue.push_back(curTid);
+    uint32_t nextTid = threadQueue.front();
+    threadQueue.pop_front();
+    if (nextTid != curTid) switchCount++;
+    return nextTid;
+}
+
+// Forked children leave the domain; join again with a free index
+void domainChildFork(THREADID tid, const CONTEXT* ctxt, void* dummy) {
+    spin::joinDomain(KnobDomain.Value().c_str());
+}
+
+void codePressure(spin::CodePressure level) {
+    info("Code cache pressure level %d", level);
+}
+
 void trace(TRACE trace, spin::TraceInfo& pt) {
     for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
         for (INS ins = BBL_InsHead(bbl); INS_Valid(ins); ins = INS_Next(ins)) {
             if (INS_IsMemoryRead(ins)) pt.insertCall(ins, IPOINT_BEFORE, (AFUNPTR) countLoad);
             if (INS_HasMemoryRead2(ins)) pt.insertCall(ins, IPOINT_BEFORE, (AFUNPTR) countLoad);
         }
+        // Under heavy code cache pressure, switch only at trace heads
+        if (spin::getCodePressure() >= spin::PRESSURE_COARSE && bbl != TRACE_BblHead(trace)) continue;
 #if 1
         //INS tgtIns = BBL_InsTail(bbl); 
         INS tgtIns = BBL_InsHead(bbl);
@@ -178,6 +225,13 @@ int main(int argc, char *argv[]) {
     PIN_InitSymbols();
     if (PIN_Init(argc, argv)) info("Wrong args");
     spin::init(trace, threadStart, threadEnd, capture, uncapture);
+    if (KnobSpinYield.Value()) spin::setSpinCallback(spinYield, true);
+    if (KnobCodePressure.Value()) spin::enableCodePressurePolicy(codePressure);
+    if (KnobFutexEmulation.Value()) spin::enableFutexEmulation(futexWait, futexWake);
+    if (!KnobDomain.Value().empty()) {
+        spin::joinDomain(KnobDomain.Value().c_str());
+        PIN_AddForkFunction(FPOINT_AFTER_IN_CHILD, domainChildFork, 0);
+    }
     PIN_AddFiniFunction(fini, 0);
     PIN_StartProgram();
     return 0;
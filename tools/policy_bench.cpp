@@ -0,0 +1,136 @@
+/** $lic$
+ * Copyright (C) 2015-2020 by Massachusetts Institute of Technology
+ *
+ * This file is part of libspin.
+ *
+ * libspin is free software; you can redistribute it and/or modify it under the
+ * terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * libspin was developed as part of the Swarm architecture simulator. If you
+ * use this software in your research, we request that you reference the Swarm
+ * paper ("A Scalable Architecture for Ordered Parallelism", Jeffrey et al.,
+ * MICRO-48, 2015) as the source of libspin in any publications that use this
+ * software, and that you send us a citation of your work.
+ *
+ * libspin is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Scheduling policy benchmark: switches threads at every basic block with
+ * one of the policies in spin_policies.h and reports switch throughput.
+ * Run with -policy rr|random|priority|fair|lottery [-seed N].
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <time.h>
+
+#include "spin.h"
+#include "spin_policies.h"
+
+using namespace spin::policies;
+
+KNOB<std::string> KnobPolicy(KNOB_MODE_WRITEONCE, "pintool", "policy", "rr",
+        "scheduling policy: rr, random, priority, fair, or lottery");
+KNOB<uint64_t> KnobSeed(KNOB_MODE_WRITEONCE, "pintool", "seed", "1",
+        "seed for the random and lottery policies");
+
+uint64_t switchcalls = 0;
+uint64_t switches = 0;
+uint64_t uncaptures = 0;
+uint64_t startNs;
+
+static uint64_t nowNs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+}
+
+template <typename Policy>
+spin::ThreadId benchSwitch(spin::ThreadId tid) {
+    switchcalls++;
+    spin::ThreadId next = switchcall<Policy>(tid);
+    if (next != tid) switches++;
+    return next;
+}
+
+template <typename Policy>
+spin::ThreadId benchUncapture(spin::ThreadId tid, spin::ThreadContext* tc) {
+    uncaptures++;
+    return uncapture<Policy>(tid, tc);
+}
+
+// Skewed per-thread parameters, so the weighted policies have work to do
+void capture(spin::ThreadId tid, bool runsNext) {
+    instance<StaticPriority>().setPriority(tid, tid % 4);
+    instance<WeightedFair>().setWeight(tid, 1 + tid % 4);
+    instance<Lottery>().setTickets(tid, 1 + tid % 4);
+}
+
+void threadStart(spin::ThreadId tid) {}
+void threadEnd(spin::ThreadId tid) {}
+
+AFUNPTR switchFunc;
+
+void trace(TRACE trace, spin::TraceInfo& pt) {
+    for (BBL bbl = TRACE_BblHead(trace); BBL_Valid(bbl); bbl = BBL_Next(bbl)) {
+        pt.insertSwitchCall(BBL_InsHead(bbl), IPOINT_BEFORE, switchFunc, IARG_SPIN_THREAD_ID);
+    }
+}
+
+void fini(int tid, void* dummy) {
+    double secs = (nowNs() - startNs) / 1e9;
+    fprintf(stderr, "Policy benchmark finished, policy %s seed %ld:\n",
+            KnobPolicy.Value().c_str(), KnobSeed.Value());
+    fprintf(stderr, " switchcalls: %ld (%.0f/s)\n", switchcalls, switchcalls / secs);
+    fprintf(stderr, " switches: %ld (%.0f/s)\n", switches, switches / secs);
+    fprintf(stderr, " uncaptures: %ld\n", uncaptures);
+    fprintf(stderr, " time: %.3f s\n", secs);
+    fflush(stderr);
+}
+
+template <typename Policy>
+static spin::UncaptureCallback selectPolicy() {
+    switchFunc = (AFUNPTR) benchSwitch<Policy>;
+    return benchUncapture<Policy>;
+}
+
+int main(int argc, char *argv[]) {
+    if (PIN_Init(argc, argv)) {
+        fprintf(stderr, "Wrong args\n");
+        return 1;
+    }
+
+    const std::string& p = KnobPolicy.Value();
+    spin::UncaptureCallback uncaptureCb;
+    if (p == "rr") {
+        uncaptureCb = selectPolicy<RoundRobin>();
+    } else if (p == "random") {
+        instance<Random>() = Random(KnobSeed.Value());
+        uncaptureCb = selectPolicy<Random>();
+    } else if (p == "priority") {
+        uncaptureCb = selectPolicy<StaticPriority>();
+    } else if (p == "fair") {
+        uncaptureCb = selectPolicy<WeightedFair>();
+    } else if (p == "lottery") {
+        instance<Lottery>() = Lottery(KnobSeed.Value());
+        uncaptureCb = selectPolicy<Lottery>();
+    } else {
+        fprintf(stderr, "Unknown policy %s\n", p.c_str());
+        return 1;
+    }
+
+    spin::init(trace, threadStart, threadEnd, capture, uncaptureCb);
+    PIN_AddFiniFunction(fini, 0);
+    startNs = nowNs();
+    PIN_StartProgram();
+    return 0;
+}